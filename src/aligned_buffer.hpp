@@ -0,0 +1,117 @@
+#ifndef _ALIGNED_BUFFER_HPP_
+#define _ALIGNED_BUFFER_HPP_ 1
+
+// system includes
+#include <cstddef>
+#include <stdint.h>
+
+
+//-----------------------------------------------------------------------------
+// Alignment of the band buffers: a cache line, so no two threads ever write
+// to the same line and the kernels start their rows on a vector boundary.
+static const size_t BUFFER_ALIGNMENT = 64;
+
+
+// Rounds a size up to a multiple of BUFFER_ALIGNMENT, so buffers packed
+// back to back all stay aligned.
+inline size_t align_size (const size_t size)
+{
+  return (size + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Heap buffer aligned to BUFFER_ALIGNMENT. It only grows: asking for less
+// room than it has keeps the memory, so a buffer that is reused band after
+// band is allocated once.
+class AlignedBuffer
+{
+public:
+
+  // Creates an empty buffer.
+  AlignedBuffer ();
+
+  // Creates a buffer of size bytes.
+  explicit AlignedBuffer (const size_t size);
+
+  // Frees the memory.
+  ~AlignedBuffer ();
+
+  // Makes room for size bytes. The contents are lost when the buffer has
+  // to grow.
+  void reserve (const size_t size);
+
+  // Returns the aligned memory, NULL while the buffer is empty.
+  char* get () const;
+
+  // Returns the number of bytes the buffer holds.
+  size_t get_capacity () const;
+
+private:
+
+  // memory as allocated and its aligned start
+  char   *m_raw;
+  char   *m_data;
+  size_t m_capacity;
+
+  // not copyable
+  AlignedBuffer (const AlignedBuffer&);
+  AlignedBuffer& operator= (const AlignedBuffer&);
+};
+
+
+inline AlignedBuffer::AlignedBuffer ()
+:
+  m_raw (NULL),
+  m_data (NULL),
+  m_capacity (0)
+{}
+
+
+inline AlignedBuffer::AlignedBuffer (const size_t size)
+:
+  m_raw (NULL),
+  m_data (NULL),
+  m_capacity (0)
+{
+  reserve (size);
+}
+
+
+inline AlignedBuffer::~AlignedBuffer ()
+{
+  delete[] m_raw;
+}
+
+
+inline void AlignedBuffer::reserve (const size_t size)
+{
+  if (size <= m_capacity)
+    {
+      return;
+    }
+  delete[] m_raw;
+  m_raw      = new char[size + BUFFER_ALIGNMENT - 1];
+  m_data     = (char*)(((uintptr_t)m_raw + BUFFER_ALIGNMENT - 1) & ~(uintptr_t)(BUFFER_ALIGNMENT - 1));
+  m_capacity = size;
+}
+
+
+inline char* AlignedBuffer::get () const
+{
+  return m_data;
+}
+
+
+inline size_t AlignedBuffer::get_capacity () const
+{
+  return m_capacity;
+}
+
+
+
+#endif // #ifndef _ALIGNED_BUFFER_HPP_
+
+
+/* vim: set ts=2 sw=2 : */
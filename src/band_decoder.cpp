@@ -0,0 +1,121 @@
+// system includes
+#include <algorithm>
+// myself
+#include "band_decoder.hpp"
+
+
+// Working set of a band of rows: the decoded rows of all the channels and
+// the 8-bit rows of a layer. Sized to stay in a typical L2 cache, before
+// rounding up to whole blocks and tiles.
+static const size_t BAND_BYTES = 256 * 1024;
+
+
+size_t choose_band_rows (const exr::File &file,
+                         const size_t    tile_rows)
+{
+  size_t row_bytes = 4 * file.get_width();
+  for (size_t i = 0; i < file.get_layer_count(); ++i)
+    {
+      const exr::Layer *layer = file.get_layer_at(i);
+      for (size_t j = 0; j < layer->get_channel_count(); ++j)
+        {
+          const exr::Channel *channel = layer->get_channel_at(j);
+          row_bytes += channel->get_y_stride() / channel->get_y_sampling();
+        }
+    }
+
+  // smallest height that is a multiple of all of them
+  size_t step = file.get_lines_per_block();
+  size_t a    = step;
+  size_t b    = std::max (tile_rows, (size_t)2);
+  while (b != 0)
+    {
+      const size_t r = a % b;
+      a              = b;
+      b              = r;
+    }
+  step = step / a * std::max (tile_rows, (size_t)2);
+  step = step + step % 2;
+
+  const size_t rows = std::max (BAND_BYTES / row_bytes, (size_t)1);
+  return (rows + step - 1) / step * step;
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Implementation of BandDecoder
+
+
+BandDecoder::BandDecoder (exr::File    &file,
+                          const size_t band_rows,
+                          const size_t extra_rows)
+:
+  m_file (file),
+  m_band_rows (band_rows),
+  m_extra_rows (extra_rows),
+  m_bands (DECODE_SLOTS),
+  m_worker (NULL)
+{
+  m_worker = new WorkerThread<BandDecoder> (*this, &BandDecoder::decode);
+}
+
+
+BandDecoder::~BandDecoder ()
+{
+  m_bands.close ();
+  delete m_worker;
+}
+
+
+bool BandDecoder::take (size_t      &slot,
+                        std::string &error_msg)
+{
+  if (!m_bands.wait_for_item ())
+    {
+      error_msg = "decoding stopped";
+      return false;
+    }
+
+  const DecodedBand &band = m_bands.get_front ();
+  slot = band.m_slot;
+  if (!band.m_decoded)
+    {
+      // the thread stopped after the failure, so the error is ours to read
+      error_msg = m_error;
+      return false;
+    }
+  return true;
+}
+
+
+void BandDecoder::give_back ()
+{
+  m_bands.pop ();
+}
+
+
+void BandDecoder::decode ()
+{
+  const size_t height = m_file.get_height();
+  for (size_t k = 0; k * m_band_rows < height && m_bands.wait_for_room (); ++k)
+    {
+      const size_t y_begin = k * m_band_rows;
+      const size_t y_end   = std::min (y_begin + m_band_rows + m_extra_rows, height);
+      const size_t slot    = k % DECODE_SLOTS;
+      const bool   decoded = m_file.read_rows (y_begin, y_end - y_begin, slot, m_error);
+
+      DecodedBand &band = m_bands.get_back ();
+      band.m_slot       = slot;
+      band.m_decoded    = decoded;
+      m_bands.push ();
+      if (!decoded)
+        {
+          break;
+        }
+    }
+}
+
+
+
+/* vim: set ts=2 sw=2 : */
@@ -0,0 +1,99 @@
+#ifndef _BAND_DECODER_HPP_
+#define _BAND_DECODER_HPP_ 1
+
+// system includes
+#include <string>
+// plugin includes
+#include "exr_file.hpp"
+#include "spsc_ring.hpp"
+#include "worker_thread.hpp"
+
+
+//-----------------------------------------------------------------------------
+// Picks the number of rows processed at once. Bands are a whole number of
+// compressed blocks, so no block is decompressed twice, and of GIMP tile
+// rows, so each band fills whole tiles. They are always even, so chroma
+// rows never straddle two bands.
+//
+// @param[in]   file
+//  file to convert
+// @param[in]   tile_rows
+//  height of a GIMP tile
+// @return
+//  band height in rows
+size_t choose_band_rows (const exr::File &file,
+                         const size_t    tile_rows);
+
+
+
+//-----------------------------------------------------------------------------
+// Number of bands in flight while streaming: one being converted and up to
+// two decoded ahead of it. Each takes a row slot of the channels.
+const size_t DECODE_SLOTS = 3;
+
+
+// A band in a row slot of the channels, handed from the decoder to the
+// converter.
+struct DecodedBand
+{
+  // row slot holding the band
+  size_t m_slot;
+  // false when decoding the band failed
+  bool   m_decoded;
+};
+
+
+// Decodes the bands of an open file on a thread of its own, ahead of the
+// conversion. The bands are handed over through a ring of DECODE_SLOTS
+// places, band k going to row slot k % DECODE_SLOTS of the channels; the
+// converter holds on to its place until it's done with the rows, so the
+// decoder waits when the conversion falls behind.
+class BandDecoder
+{
+public:
+
+  // Starts decoding bands of band_rows rows, each with extra_rows rows of
+  // the next band on top, e.g. the chroma row bilinear filtering needs.
+  BandDecoder (exr::File    &file,
+               const size_t band_rows,
+               const size_t extra_rows);
+
+  // Stops decoding and joins the thread.
+  ~BandDecoder ();
+
+  // Waits for the next band.
+  //
+  // @param[out]  slot
+  //  row slot holding the band
+  // @param[out]  error_msg
+  //  error message, only set when this function fails
+  // @return
+  //  true on success, false when decoding the band failed
+  bool take (size_t      &slot,
+             std::string &error_msg);
+
+  // Hands the slot of the band taken back, its rows are no longer used.
+  void give_back ();
+
+private:
+
+  // Decodes the bands, runs on the thread.
+  void decode ();
+
+  exr::File                 &m_file;
+  const size_t              m_band_rows;
+  const size_t              m_extra_rows;
+  // decoded bands on their way to the converter
+  SpscRing<DecodedBand>     m_bands;
+  // error of the band that failed, only read once the thread stopped
+  std::string               m_error;
+  // thread decoding the bands, started last and joined first
+  WorkerThread<BandDecoder> *m_worker;
+};
+
+
+
+#endif // #ifndef _BAND_DECODER_HPP_
+
+
+/* vim: set ts=2 sw=2 : */
@@ -0,0 +1,1052 @@
+// C includes
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// C++ includes
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <vector>
+// GIMP includes
+#include <glib.h>
+// OpenEXR includes
+#include <half.h>
+#include <IlmThreadPool.h>
+#include <ImfChannelList.h>
+#include <ImfFrameBuffer.h>
+#include <ImfHeader.h>
+#include <ImfOutputFile.h>
+// plugin includes
+#include "aligned_buffer.hpp"
+#include "band_decoder.hpp"
+#include "conversion.hpp"
+#include "exr_file.hpp"
+#include "kernels.hpp"
+#include "local_tone.hpp"
+#include "spsc_ring.hpp"
+#include "thread_pool.hpp"
+#include "worker_thread.hpp"
+
+
+//-----------------------------------------------------------------------------
+// Standalone benchmark of the conversion pipeline, it doesn't need GIMP. It
+// writes a synthetic HDR image to a temporary EXR file, reads it back with
+// exr::File and times the parts of a load on it. Each case is run until it
+// took a while and the fastest run is reported.
+//
+// usage: bench [-s WIDTHxHEIGHT] [-t THREADS] [CASE...]
+//
+// Without cases all of them run, see print_usage().
+
+
+// Least time spent on a case, in microseconds, and least number of runs.
+static const gint64 MIN_CASE_TIME = 500000;
+static const int    MIN_CASE_RUNS = 3;
+
+
+// Something to time.
+class BenchCase
+{
+public:
+
+  virtual ~BenchCase () {}
+
+  // Does the work once, returns false when it failed.
+  virtual bool run () = 0;
+};
+
+
+// Runs a case at least MIN_CASE_RUNS times and for MIN_CASE_TIME, and
+// returns its fastest run in seconds. Stops when a run fails.
+static double time_case (BenchCase &bench_case)
+{
+  gint64 best  = G_MAXINT64;
+  gint64 total = 0;
+  for (int runs = 0; runs < MIN_CASE_RUNS || total < MIN_CASE_TIME; ++runs)
+    {
+      const gint64 start = g_get_monotonic_time ();
+      const bool   success = bench_case.run ();
+      const gint64 time = g_get_monotonic_time () - start;
+      best   = std::min (best, time);
+      total += time;
+      if (!success)
+        {
+          break;
+        }
+    }
+  return (double)best * 1e-6;
+}
+
+
+// Prints the time a case took for a number of pixels, or other units.
+static void report (const char   *name,
+                    const double seconds,
+                    const size_t count,
+                    const char   *unit = "pixel")
+{
+  printf ("  %-28s %10.2f ms %8.2f ns/%s\n",
+          name,
+          seconds * 1e3,
+          seconds * 1e9 / (double)count,
+          unit);
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Synthetic image
+
+
+// Writes the test image: a horizontal ramp over 12 stops, tinted down the
+// image, with a little noise so it doesn't compress unusually well, and an
+// alpha ramp. The default layer holds half RGBA, layer "float" the same as
+// float, both with the default ZIP compression. The image is written a row
+// at a time, so large ones don't take much memory.
+static bool write_image (const std::string &path,
+                         const size_t      width,
+                         const size_t      height,
+                         std::string       &error_msg)
+{
+  static const char *const NAMES[4] = { "R", "G", "B", "A" };
+
+  try
+    {
+      Imf::Header header ((int)width, (int)height);
+      for (size_t c = 0; c < 4; ++c)
+        {
+          header.channels().insert (NAMES[c], Imf::Channel (Imf::HALF));
+          header.channels().insert ((std::string ("float.") + NAMES[c]).c_str(),
+                                    Imf::Channel (Imf::FLOAT));
+        }
+      Imf::OutputFile file (path.c_str(), header);
+
+      std::vector<half>  halfs (width * 4);
+      std::vector<float> floats (width * 4);
+      guint32            noise = 1;
+      for (size_t y = 0; y < height; ++y)
+        {
+          const float v = (float)y / (float)height;
+          for (size_t x = 0; x < width; ++x)
+            {
+              noise = noise * 1664525u + 1013904223u;
+              const float grain = 1.0f + 0.05f * ((float)(noise >> 8) / 16777216.0f - 0.5f);
+              const float value = exp2f (12.0f * (float)x / (float)width - 8.0f) * grain;
+              float *pixel = &floats[x * 4];
+              pixel[3] = 0.25f + 0.75f * v;
+              pixel[0] = value * pixel[3];
+              pixel[1] = value * (1.0f - 0.5f * v) * pixel[3];
+              pixel[2] = value * (0.5f + 0.5f * v) * pixel[3];
+              for (size_t c = 0; c < 4; ++c)
+                {
+                  halfs[x * 4 + c] = pixel[c];
+                }
+            }
+
+          // the slices point at row y of an image that starts before them
+          Imf::FrameBuffer frame_buffer;
+          for (size_t c = 0; c < 4; ++c)
+            {
+              frame_buffer.insert (NAMES[c],
+                                   Imf::Slice (Imf::HALF,
+                                               (char*)(&halfs[c] - y * width * 4),
+                                               4 * sizeof (half),
+                                               4 * sizeof (half) * width));
+              frame_buffer.insert ((std::string ("float.") + NAMES[c]).c_str(),
+                                   Imf::Slice (Imf::FLOAT,
+                                               (char*)(&floats[c] - y * width * 4),
+                                               4 * sizeof (float),
+                                               4 * sizeof (float) * width));
+            }
+          file.setFrameBuffer (frame_buffer);
+          file.writePixels (1);
+        }
+    }
+  catch (std::exception &e)
+    {
+      error_msg = e.what();
+      return false;
+    }
+
+  return true;
+}
+
+
+// Builds the inputs of the first count of the R, G, B and A channels of a
+// layer, the 2 channel layout takes R and A.
+static void get_inputs (const exr::Layer          &layer,
+                        const size_t              count,
+                        std::vector<ChannelInput> &input)
+{
+  static const char *const NAMES[4][4] =
+  {
+    { "R" },
+    { "R", "A" },
+    { "R", "G", "B" },
+    { "R", "G", "B", "A" },
+  };
+
+  std::vector<const exr::Channel*> channels;
+  for (size_t i = 0; i < count; ++i)
+    {
+      channels.push_back (layer.get_channel (NAMES[count - 1][i]));
+    }
+  make_channel_inputs (channels, input);
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Conversion kernels
+
+
+// Converts all rows of a layer to 8 bits on the calling thread, with the
+// local tone map when one is given.
+class ConvertCase : public BenchCase
+{
+public:
+
+  ConvertCase (const DisplayTransform          &transform,
+               const std::vector<ChannelInput> &input,
+               const size_t                    width,
+               const size_t                    height,
+               guchar                          *output,
+               const LocalToneMap              *local = NULL)
+  :
+    m_transform (transform),
+    m_local (local),
+    m_input (input),
+    m_width (width),
+    m_height (height),
+    m_output (output)
+  {}
+
+  virtual bool run ()
+  {
+    convert_rows (m_transform, m_local, m_input, m_width, 0, m_height, m_output, NULL);
+    return true;
+  }
+
+private:
+
+  const DisplayTransform          &m_transform;
+  const LocalToneMap              *m_local;
+  const std::vector<ChannelInput> &m_input;
+  const size_t                    m_width;
+  const size_t                    m_height;
+  guchar                          *m_output;
+};
+
+
+// Times convert_rows(), and so the convert_kernel and pack_row
+// instantiations, for 1 to 4 half and float channels, and for a layer that
+// mixes data types.
+//
+// For reference, float rows on one core of a Xeon VM at -O3: 18-20 ns per
+// pixel for 1 channel up to 65-95 ns for 4, the same within noise through
+// the typed loads and through SampleLoader. The display transform takes
+// nearly all of it; loading alone is 0.5-0.66 ns per sample either way.
+static void bench_kernels (const exr::File &file)
+{
+  const size_t width  = file.get_width();
+  const size_t height = file.get_height();
+
+  ConversionSettings settings;
+  DisplayTransform   transform (settings, file.get_chromaticities());
+  AlignedBuffer      output (width * height * 4);
+
+  static const char *const LAYERS[2] = { "", "float" };
+  static const char *const TYPES[2]  = { "half", "float" };
+  printf ("kernels (convert_rows, one thread)\n");
+  for (size_t i = 0; i < 2; ++i)
+    {
+      const exr::Layer *layer = NULL;
+      file.find_layer (LAYERS[i], &layer);
+      for (size_t count = 1; count <= 4; ++count)
+        {
+          std::vector<ChannelInput> input;
+          get_inputs (*layer, count, input);
+          ConvertCase bench_case (transform, input, width, height, (guchar*)output.get());
+
+          gchar *name = g_strdup_printf ("%s x %lu", TYPES[i], (unsigned long)count);
+          report (name, time_case (bench_case), width * height);
+          g_free (name);
+        }
+    }
+
+  // half color with float alpha takes the kernel that loads each channel
+  // through its own SampleLoader, compare with half x 4
+  const exr::Layer *half_layer  = NULL;
+  const exr::Layer *float_layer = NULL;
+  file.find_layer ("", &half_layer);
+  file.find_layer ("float", &float_layer);
+  std::vector<ChannelInput> input;
+  get_inputs (*half_layer, 4, input);
+  input[3] = ChannelInput (float_layer->get_channel ("A"));
+  ConvertCase bench_case (transform, input, width, height, (guchar*)output.get());
+  report ("half x 3 + float alpha", time_case (bench_case), width * height);
+  printf ("\n");
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Dithering
+
+
+// Builds the tile of a dither pattern.
+class DitherPatternCase : public BenchCase
+{
+public:
+
+  explicit DitherPatternCase (const DitherMethod method)
+  :
+    m_method (method)
+  {}
+
+  virtual bool run ()
+  {
+    DitherPattern pattern (m_method);
+    return true;
+  }
+
+private:
+
+  const DitherMethod m_method;
+};
+
+
+// Times building the DitherPattern tiles and convert_rows() on half RGBA
+// with each dither method. The difference to no dithering is what
+// pack_row pays for adding the offsets.
+//
+// For reference, 1024x1024 float RGBA on one core of a Xeon VM at -O3:
+// 40-55 ns per pixel for all three methods, the dithering lost in the run
+// to run noise, and 1-1.7 ns per cell to build a tile.
+static void bench_dither (const exr::File &file)
+{
+  const size_t width  = file.get_width();
+  const size_t height = file.get_height();
+
+  const exr::Layer *layer = NULL;
+  file.find_layer ("", &layer);
+  std::vector<ChannelInput> input;
+  get_inputs (*layer, 4, input);
+  AlignedBuffer output (width * height * 4);
+
+  static const DitherMethod METHODS[3] =
+  {
+    DITHER_METHOD_NONE,
+    DITHER_METHOD_ORDERED,
+    DITHER_METHOD_BLUE_NOISE,
+  };
+  static const char *const NAMES[3] = { "none", "ordered", "blue noise" };
+  printf ("dither (half x 4, one thread)\n");
+  for (size_t i = 0; i < 3; ++i)
+    {
+      ConversionSettings settings;
+      settings.m_dither_method = METHODS[i];
+      DisplayTransform transform (settings, file.get_chromaticities());
+      ConvertCase      bench_case (transform, input, width, height, (guchar*)output.get());
+      report (NAMES[i], time_case (bench_case), width * height);
+    }
+  for (size_t i = 1; i < 3; ++i)
+    {
+      DitherPatternCase bench_case (METHODS[i]);
+      gchar *name = g_strdup_printf ("%s tile", NAMES[i]);
+      report (name, time_case (bench_case), DITHER_TILE_SIZE * DITHER_TILE_SIZE);
+      g_free (name);
+    }
+  printf ("\n");
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Local tone mapping
+
+
+// Builds the bilateral grid of a layer, on the threads of the global pool.
+class LocalBuildCase : public BenchCase
+{
+public:
+
+  LocalBuildCase (LocalToneMap                    &local,
+                  const std::vector<ChannelInput> &input,
+                  const std::vector<float>        &weights,
+                  const float                     yw[3],
+                  const size_t                    width,
+                  const size_t                    height,
+                  const ConversionSettings        &settings)
+  :
+    m_local (local),
+    m_input (input),
+    m_weights (weights),
+    m_yw (yw),
+    m_width (width),
+    m_height (height),
+    m_settings (settings)
+  {}
+
+  virtual bool run ()
+  {
+    m_local.build (m_input, m_weights, m_yw, m_width, m_height, m_settings);
+    return true;
+  }
+
+private:
+
+  LocalToneMap                    &m_local;
+  const std::vector<ChannelInput> &m_input;
+  const std::vector<float>        &m_weights;
+  const float                     *m_yw;
+  const size_t                    m_width;
+  const size_t                    m_height;
+  const ConversionSettings        &m_settings;
+};
+
+
+// Loads the RGB rows of a layer as floats on the calling thread and
+// applies the local tone map to them when one is given.
+class LocalApplyCase : public BenchCase
+{
+public:
+
+  LocalApplyCase (const std::vector<ChannelInput> &input,
+                  const size_t                    width,
+                  const size_t                    height,
+                  const LocalToneMap              *local)
+  :
+    m_input (input),
+    m_width (width),
+    m_height (height),
+    m_local (local),
+    m_rows (width * 3)
+  {}
+
+  virtual bool run ()
+  {
+    float *planes[3] = { &m_rows[0], &m_rows[m_width], &m_rows[2 * m_width] };
+    for (size_t y = 0; y < m_height; ++y)
+      {
+        for (size_t c = 0; c < 3; ++c)
+          {
+            m_input[c].load (y, 0, m_width, planes[c]);
+          }
+        if (m_local)
+          {
+            m_local->apply (planes, 3, 0, y, m_width);
+          }
+      }
+    return true;
+  }
+
+private:
+
+  const std::vector<ChannelInput> &m_input;
+  const size_t                    m_width;
+  const size_t                    m_height;
+  const LocalToneMap              *m_local;
+  std::vector<float>              m_rows;
+};
+
+
+// Times building the local tone map of half RGB, on the pool, and
+// applying it, on one thread: on its own, as the time to load and apply
+// minus the time to load, and as part of convert_rows().
+//
+// For reference, an 8K float RGB frame on one core of a Xeon VM: building
+// takes about 430 ms at -O3 and 380 ms with -mavx2 -mfma, applying 32-37
+// ns per pixel at -O3 and 24 ns per pixel with -mavx2 -mfma.
+static void bench_local (const exr::File &file)
+{
+  const size_t width  = file.get_width();
+  const size_t height = file.get_height();
+
+  const exr::Layer *layer = NULL;
+  file.find_layer ("", &layer);
+  std::vector<ChannelInput> input;
+  get_inputs (*layer, 3, input);
+  float yw[3];
+  file.get_chromaticities().get_luminance_weights (yw);
+  const std::vector<float> weights (yw, yw + 3);
+  AlignedBuffer output (width * height * 3);
+
+  ConversionSettings settings;
+  settings.m_local_tone_mapping = true;
+  DisplayTransform transform (settings, file.get_chromaticities());
+  LocalToneMap     local;
+
+  printf ("local tone mapping (half x 3)\n");
+  LocalBuildCase build_case (local, input, weights, yw, width, height, settings);
+  report ("build", time_case (build_case), width * height);
+
+  LocalApplyCase load_case (input, width, height, NULL);
+  LocalApplyCase apply_case (input, width, height, &local);
+  const double load_time  = time_case (load_case);
+  const double apply_time = time_case (apply_case);
+  report ("apply", std::max (apply_time - load_time, 0.0), width * height);
+
+  ConvertCase convert_case (transform, input, width, height, (guchar*)output.get());
+  ConvertCase local_case (transform, input, width, height, (guchar*)output.get(), &local);
+  report ("convert_rows", time_case (convert_case), width * height);
+  report ("convert_rows, local", time_case (local_case), width * height);
+  printf ("\n");
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Band handoff
+
+
+// Items handed through the ring per run.
+static const size_t RING_ITEMS = 1 << 20;
+
+
+// Pushes the numbers up to a count through a ring, on a thread of its own.
+class RingProducer
+{
+public:
+
+  RingProducer (SpscRing<size_t> &ring,
+                const size_t     count)
+  :
+    m_ring (ring),
+    m_count (count),
+    m_worker (NULL)
+  {
+    m_worker = new WorkerThread<RingProducer> (*this, &RingProducer::produce);
+  }
+
+  // Joins the thread.
+  ~RingProducer ()
+  {
+    delete m_worker;
+  }
+
+private:
+
+  void produce ()
+  {
+    for (size_t i = 0; i < m_count && m_ring.wait_for_room (); ++i)
+      {
+        m_ring.get_back () = i;
+        m_ring.push ();
+      }
+  }
+
+  SpscRing<size_t>           &m_ring;
+  const size_t               m_count;
+  WorkerThread<RingProducer> *m_worker;
+};
+
+
+// Hands RING_ITEMS items from a producer thread to the calling thread
+// through a ring, with nothing else to do on either side, so it's all
+// handoff and the sides keep meeting a full or an empty ring.
+class RingCase : public BenchCase
+{
+public:
+
+  explicit RingCase (const size_t capacity)
+  :
+    m_capacity (capacity),
+    m_sum (0)
+  {}
+
+  virtual bool run ()
+  {
+    SpscRing<size_t> ring (m_capacity);
+    RingProducer     producer (ring, RING_ITEMS);
+    size_t           sum = 0;
+    for (size_t i = 0; i < RING_ITEMS && ring.wait_for_item (); ++i)
+      {
+        sum += ring.get_front ();
+        ring.pop ();
+      }
+    m_sum = sum;
+    return true;
+  }
+
+private:
+
+  const size_t m_capacity;
+  // keeps the consumer from being optimized away
+  size_t       m_sum;
+};
+
+
+// Times SpscRing with as many places as the band decoder has, and with
+// many more.
+//
+// For reference, on a one core VM the two sides take turns on the core and
+// sleep on the semaphores: 2-2.8 us per item with 3 places and 0.5-0.6 us
+// with 64. A band hands over one item, next to milliseconds of decoding.
+static void bench_ring ()
+{
+  static const size_t CAPACITIES[2] = { DECODE_SLOTS, 64 };
+  printf ("SpscRing (two threads)\n");
+  for (size_t i = 0; i < 2; ++i)
+    {
+      RingCase bench_case (CAPACITIES[i]);
+      gchar *name = g_strdup_printf ("%lu places", (unsigned long)CAPACITIES[i]);
+      report (name, time_case (bench_case), RING_ITEMS, "item");
+      g_free (name);
+    }
+  printf ("\n");
+}
+
+
+// Converts a slice of the rows of a band on a thread of the global pool.
+class SliceTask : public IlmThread::Task
+{
+public:
+
+  SliceTask (IlmThread::TaskGroup            *group,
+             const DisplayTransform          &transform,
+             const std::vector<ChannelInput> &input,
+             const size_t                    width,
+             const size_t                    y_begin,
+             const size_t                    y_end,
+             guchar                          *output)
+  :
+    IlmThread::Task (group),
+    m_transform (transform),
+    m_input (input),
+    m_width (width),
+    m_y_begin (y_begin),
+    m_y_end (y_end),
+    m_output (output)
+  {}
+
+  virtual void execute ()
+  {
+    convert_rows (m_transform, NULL, m_input, m_width, m_y_begin, m_y_end, m_output, NULL);
+  }
+
+private:
+
+  const DisplayTransform          &m_transform;
+  const std::vector<ChannelInput> &m_input;
+  const size_t                    m_width;
+  const size_t                    m_y_begin;
+  const size_t                    m_y_end;
+  guchar                          *m_output;
+};
+
+
+// Converts rows [y_begin, y_end) split over the threads of the pool, like
+// the plugin converts a band of a layer, and waits for them.
+static void convert_band (const DisplayTransform          &transform,
+                          const std::vector<ChannelInput> &input,
+                          const size_t                    width,
+                          const size_t                    y_begin,
+                          const size_t                    y_end,
+                          guchar                          *output)
+{
+  const size_t threads = IlmThread::ThreadPool::globalThreadPool().numThreads();
+  if (threads < 2)
+    {
+      convert_rows (transform, NULL, input, width, y_begin, y_end, output, NULL);
+      return;
+    }
+
+  const size_t slice = std::max ((y_end - y_begin + threads - 1) / threads, (size_t)1);
+  // the group waits for its tasks when it goes
+  IlmThread::TaskGroup group;
+  for (size_t y = y_begin; y < y_end; y += slice)
+    {
+      IlmThread::ThreadPool::addGlobalTask (
+          new SliceTask (&group,
+                         transform,
+                         input,
+                         width,
+                         y,
+                         std::min (y + slice, y_end),
+                         output + (y - y_begin) * width * 4));
+    }
+}
+
+
+// Width and height of the tiles of the layers written to.
+static const size_t TILE_SIZE = 64;
+
+
+// Copies the 8-bit RGBA rows of a band into the tiles of a layer, tile by
+// tile like GIMP fills the tiles of a layer. Tiles are TILE_SIZE rows high
+// and stored one after the other, a row of tiles at a time, even at the
+// right and bottom edges. y_begin must be a multiple of TILE_SIZE.
+static void write_tiles (const guchar *pixels,
+                         const size_t width,
+                         const size_t y_begin,
+                         const size_t rows,
+                         guchar       *tiles)
+{
+  const size_t tile_bytes = TILE_SIZE * TILE_SIZE * 4;
+  const size_t tiles_wide = (width + TILE_SIZE - 1) / TILE_SIZE;
+  for (size_t ty = 0; ty < rows; ty += TILE_SIZE)
+    {
+      const size_t tile_rows = std::min (TILE_SIZE, rows - ty);
+      guchar       *tile_row = tiles + (y_begin + ty) / TILE_SIZE * tiles_wide * tile_bytes;
+      for (size_t tx = 0; tx < width; tx += TILE_SIZE)
+        {
+          const size_t row_bytes = std::min (TILE_SIZE, width - tx) * 4;
+          guchar       *tile     = tile_row + tx / TILE_SIZE * tile_bytes;
+          for (size_t y = 0; y < tile_rows; ++y)
+            {
+              memcpy (tile + y * TILE_SIZE * 4,
+                      pixels + ((ty + y) * width + tx) * 4,
+                      row_bytes);
+            }
+        }
+    }
+}
+
+
+// Returns the size of the tiles of a layer in bytes.
+static size_t get_tiles_size (const size_t width,
+                              const size_t height)
+{
+  return ((width + TILE_SIZE - 1) / TILE_SIZE) *
+         ((height + TILE_SIZE - 1) / TILE_SIZE) *
+         TILE_SIZE * TILE_SIZE * 4;
+}
+
+
+// Copies a converted band into the tiles of a layer once per band of the
+// image, on its own, which is the copy the tile-aligned bands leave.
+class TileCopyCase : public BenchCase
+{
+public:
+
+  TileCopyCase (const guchar *pixels,
+                const size_t width,
+                const size_t height,
+                const size_t band_rows,
+                guchar       *tiles)
+  :
+    m_pixels (pixels),
+    m_width (width),
+    m_height (height),
+    m_band_rows (band_rows),
+    m_tiles (tiles)
+  {}
+
+  virtual bool run ()
+  {
+    for (size_t y = 0; y < m_height; y += m_band_rows)
+      {
+        write_tiles (m_pixels, m_width, y, std::min (m_band_rows, m_height - y), m_tiles);
+      }
+    return true;
+  }
+
+private:
+
+  const guchar *m_pixels;
+  const size_t m_width;
+  const size_t m_height;
+  const size_t m_band_rows;
+  guchar       *m_tiles;
+};
+
+
+// The steps of streaming a file a band at a time.
+enum PipelineMode
+{
+  // decode each band on the calling thread
+  PIPELINE_MODE_DECODE,
+  // decode each band and then convert it, one after the other
+  PIPELINE_MODE_SERIAL,
+  // decode on the band decoder's thread while converting the band before
+  PIPELINE_MODE_OVERLAP,
+  // overlapped, and the band is then written to the layer tiles
+  PIPELINE_MODE_TILES,
+  // overlapped, and the band is written to shadow tiles that are then
+  // merged into the layer tiles, the way layers used to be written
+  PIPELINE_MODE_SHADOW,
+};
+
+
+// Streams the half RGBA layer of a file a band at a time, as far as the
+// rows ready to be written to GIMP.
+class PipelineCase : public BenchCase
+{
+public:
+
+  PipelineCase (exr::File              &file,
+                const PipelineMode     mode,
+                const DisplayTransform &transform,
+                const size_t           band_rows,
+                guchar                 *output,
+                guchar                 *tiles,
+                guchar                 *shadow_tiles)
+  :
+    m_file (file),
+    m_mode (mode),
+    m_transform (transform),
+    m_band_rows (band_rows),
+    m_output (output),
+    m_tiles (tiles),
+    m_shadow_tiles (shadow_tiles),
+    m_success (true)
+  {}
+
+  virtual bool run ()
+  {
+    const size_t width  = m_file.get_width();
+    const size_t height = m_file.get_height();
+
+    const exr::Layer *layer = NULL;
+    m_file.find_layer ("", &layer);
+    std::vector<ChannelInput> input;
+    get_inputs (*layer, 4, input);
+
+    BandDecoder *decoder = m_mode >= PIPELINE_MODE_OVERLAP
+                           ? new BandDecoder (m_file, m_band_rows, 0)
+                           : NULL;
+    m_success = true;
+    for (size_t y_begin = 0; y_begin < height; y_begin += m_band_rows)
+      {
+        const size_t y_end = std::min (y_begin + m_band_rows, height);
+        size_t slot = 0;
+        m_success = decoder ? decoder->take (slot, m_error)
+                            : m_file.read_rows (y_begin, y_end - y_begin, m_error);
+        if (!m_success)
+          {
+            break;
+          }
+        if (m_mode != PIPELINE_MODE_DECODE)
+          {
+            set_input_slot (input, slot);
+            convert_band (m_transform, input, width, y_begin, y_end, m_output);
+          }
+        if (m_mode == PIPELINE_MODE_TILES)
+          {
+            write_tiles (m_output, width, y_begin, y_end - y_begin, m_tiles);
+          }
+        else if (m_mode == PIPELINE_MODE_SHADOW)
+          {
+            // the merge copies the shadow tiles of the band as they are
+            const size_t first = get_tiles_size (width, y_begin);
+            const size_t last  = get_tiles_size (width, y_end);
+            write_tiles (m_output, width, y_begin, y_end - y_begin, m_shadow_tiles);
+            memcpy (m_tiles + first, m_shadow_tiles + first, last - first);
+          }
+        if (decoder)
+          {
+            decoder->give_back ();
+          }
+      }
+    delete decoder;
+    return m_success;
+  }
+
+  // Returns false when reading the file failed, error_msg then tells why.
+  bool is_ok (std::string &error_msg) const
+  {
+    error_msg = m_error;
+    return m_success;
+  }
+
+private:
+
+  exr::File              &m_file;
+  const PipelineMode     m_mode;
+  const DisplayTransform &m_transform;
+  const size_t           m_band_rows;
+  guchar                 *m_output;
+  guchar                 *m_tiles;
+  guchar                 *m_shadow_tiles;
+  bool                   m_success;
+  std::string            m_error;
+};
+
+
+// Times streaming the half RGBA layer of the file, a band at a time in a
+// band buffer: decoding alone, decoding and converting one after the
+// other, and overlapped through the band decoder. Bands are sized for
+// GIMP's default tile height. The last two runs also write the bands to
+// the tiles of a layer in memory, directly and through shadow tiles. That
+// is the copying GIMP does to store the rows, without the transfer from
+// the plugin to GIMP, which needs GIMP itself. The copy into the tiles is
+// also timed on its own.
+//
+// For reference, the copy alone takes 0.6-0.75 ns per pixel for 4096x4096
+// and 7680x4320 RGBA in 64-row bands on one core of a Xeon VM, under 2% of
+// the 40-55 ns per pixel convert_rows() takes for RGBA there.
+static bool bench_pipeline (const std::string &path,
+                            std::string       &error_msg)
+{
+  exr::File file (path);
+  if (!file.open (error_msg))
+    {
+      return false;
+    }
+  const size_t width     = file.get_width();
+  const size_t height    = file.get_height();
+  const size_t band_rows = std::min (choose_band_rows (file, 64), height);
+
+  ConversionSettings settings;
+  DisplayTransform   transform (settings, file.get_chromaticities());
+  AlignedBuffer      output (band_rows * width * 4);
+  AlignedBuffer      tiles (get_tiles_size (width, height));
+  AlignedBuffer      shadow_tiles (get_tiles_size (width, height));
+
+  static const PipelineMode MODES[5] =
+  {
+    PIPELINE_MODE_DECODE,
+    PIPELINE_MODE_SERIAL,
+    PIPELINE_MODE_OVERLAP,
+    PIPELINE_MODE_TILES,
+    PIPELINE_MODE_SHADOW,
+  };
+  static const char *const NAMES[5] =
+  {
+    "decode",
+    "decode, convert",
+    "overlapped",
+    "overlapped, tiles",
+    "overlapped, shadow tiles",
+  };
+  printf ("band pipeline (half x 4, %lu rows per band)\n", (unsigned long)band_rows);
+  for (size_t i = 0; i < 5; ++i)
+    {
+      PipelineCase bench_case (file,
+                               MODES[i],
+                               transform,
+                               band_rows,
+                               (guchar*)output.get(),
+                               (guchar*)tiles.get(),
+                               (guchar*)shadow_tiles.get());
+      const double seconds = time_case (bench_case);
+      if (!bench_case.is_ok (error_msg))
+        {
+          return false;
+        }
+      report (NAMES[i], seconds, width * height);
+    }
+  TileCopyCase copy_case ((const guchar*)output.get(),
+                          width,
+                          height,
+                          band_rows,
+                          (guchar*)tiles.get());
+  report ("tile copy alone", time_case (copy_case), width * height);
+  printf ("\n");
+  return true;
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Main
+
+
+// Prints how to run the benchmark.
+static void print_usage (const char *program)
+{
+  fprintf (stderr,
+           "usage: %s [-s WIDTHxHEIGHT] [-t THREADS] [CASE...]\n"
+           "\n"
+           "  -s  size of the test image, 1920x1080 by default\n"
+           "  -t  worker threads, the number of processors by default\n"
+           "\n"
+           "cases, all by default:\n"
+           "  kernels   convert_rows for 1 to 4 half and float channels\n"
+           "  dither    convert_rows with each dither method, dither tiles\n"
+           "  local     building and applying the local tone map\n"
+           "  ring      handing items between two threads with SpscRing\n"
+           "  pipeline  streaming a layer through the band decoder, and into\n"
+           "            the tiles of a layer\n",
+           program);
+}
+
+
+// Checks if a case was asked for, all are when none is named.
+static bool wants_case (const std::vector<std::string> &cases,
+                        const char                     *name)
+{
+  return cases.empty() || std::find (cases.begin(), cases.end(), name) != cases.end();
+}
+
+
+int main (int  argc,
+          char **argv)
+{
+  size_t width   = 1920;
+  size_t height  = 1080;
+  int    threads = (int)g_get_num_processors ();
+  std::vector<std::string> cases;
+  for (int i = 1; i < argc; ++i)
+    {
+      unsigned long w = 0;
+      unsigned long h = 0;
+      if (!strcmp (argv[i], "-s") && i + 1 < argc &&
+          sscanf (argv[i + 1], "%lux%lu", &w, &h) == 2 && w > 0 && h > 0)
+        {
+          width  = w;
+          height = h;
+          ++i;
+        }
+      else if (!strcmp (argv[i], "-t") && i + 1 < argc)
+        {
+          threads = atoi (argv[++i]);
+        }
+      else if (argv[i][0] != '-')
+        {
+          cases.push_back (argv[i]);
+        }
+      else
+        {
+          print_usage (argv[0]);
+          return EXIT_FAILURE;
+        }
+    }
+
+  init_thread_pool (threads);
+
+  gchar *path = g_build_filename (g_get_tmp_dir (), "gimp-exr-bench.exr", NULL);
+  std::string error_msg;
+  exr::File   file (path);
+  bool        success = write_image (path, width, height, error_msg) &&
+                        file.load (error_msg);
+  if (success)
+    {
+      printf ("%lux%lu pixels, %d threads\n\n",
+              (unsigned long)width,
+              (unsigned long)height,
+              threads);
+      if (wants_case (cases, "kernels"))
+        {
+          bench_kernels (file);
+        }
+      if (wants_case (cases, "dither"))
+        {
+          bench_dither (file);
+        }
+      if (wants_case (cases, "local"))
+        {
+          bench_local (file);
+        }
+      if (wants_case (cases, "ring"))
+        {
+          bench_ring ();
+        }
+      if (wants_case (cases, "pipeline"))
+        {
+          success = bench_pipeline (path, error_msg);
+        }
+    }
+  if (!success)
+    {
+      fprintf (stderr, "%s\n", error_msg.c_str());
+    }
+
+  remove (path);
+  g_free (path);
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/* vim: set ts=2 sw=2 : */
@@ -1,11 +1,25 @@
 // system includes
 #include <algorithm>
+#include <string.h>
 // GIMP includes
 #include <libgimp/gimp.h>
+#if GIMP_CHECK_VERSION (2, 10, 0)
+#include <gegl.h>
+#endif
 // OpenEXR includes
-#include <half.h>
+#include <IlmThread.h>
+#include <IlmThreadMutex.h>
+#include <IlmThreadPool.h>
+#include <IlmThreadSemaphore.h>
 // plugin includes
+#include "aligned_buffer.hpp"
+#include "band_decoder.hpp"
 #include "exr_file.hpp"
+#include "kernels.hpp"
+#include "load_future.hpp"
+#include "load_progress.hpp"
+#include "local_tone.hpp"
+#include "luminance.hpp"
 // myself
 #include "conversion.hpp"
 
@@ -19,6 +33,8 @@ using namespace exr;
 //
 // @param[in]   type
 //  GIMP image type
+// @param[in]   precision
+//  precision of the image, high precisions need GIMP 2.10
 // @param[in]   width
 //  width of the image in pixels
 // @param[in]   height
@@ -31,12 +47,30 @@ using namespace exr;
 // @return
 //  true on success, false on failure
 static bool create_gimp_image (const GimpImageBaseType type,
+                               const ImagePrecision    precision,
                                size_t                  width,
                                size_t                  height,
                                gint32                  &image_id,
                                std::string             &error_msg)
 {
-  image_id = gimp_image_new (width, height, type);
+  if (precision == IMAGE_PRECISION_U8)
+    {
+      image_id = gimp_image_new (width, height, type);
+    }
+  else
+    {
+#if GIMP_CHECK_VERSION (2, 10, 0)
+      image_id = gimp_image_new_with_precision (width,
+                                                height,
+                                                type,
+                                                precision == IMAGE_PRECISION_HALF
+                                                ? GIMP_PRECISION_HALF_LINEAR
+                                                : GIMP_PRECISION_FLOAT_LINEAR);
+#else
+      error_msg = "half and float images need GIMP 2.10 or later";
+      return false;
+#endif
+    }
   if (image_id == -1)
     {
       error_msg = "failed to create GIMP image";
@@ -46,8 +80,7 @@ static bool create_gimp_image (const GimpImageBaseType type,
 }
 
 
-// Adds a layer to an existing GIMP image and copies in the provided pixel
-// data.
+// Creates an empty layer on top of an existing GIMP image.
 //
 // @param[in]   type
 //  type of layer
@@ -57,27 +90,27 @@ static bool create_gimp_image (const GimpImageBaseType type,
 //  height of the layer in pixels
 // @param[in]   image_id
 //  id of the image to which we add this layer
-// @param[in]   data
-//  pixel data in the format as expected by the layer type
+// @param[out]  layer_id
+//  id of the new layer, only valid when this function returns true
 // @param[out]  error_msg
 //  error message, only filled in when something went wrong
 // @return
 //  true on success, false on failure
-static bool add_layer (const GimpImageType type,
-                       const std::string   &layer_name,
-                       const size_t        width,
-                       const size_t        height,
-                       const gint32        image_id,
-                       const guchar        *data,
-                       std::string         &error_msg)
+static bool insert_layer (const GimpImageType type,
+                          const std::string   &layer_name,
+                          const size_t        width,
+                          const size_t        height,
+                          const gint32        image_id,
+                          gint32              &layer_id,
+                          std::string         &error_msg)
 {
-  const gint32 layer_id = gimp_layer_new (image_id,
-                                          layer_name.c_str(),
-                                          width,
-                                          height,
-                                          type,
-                                          100.0,
-                                          GIMP_NORMAL_MODE);
+  layer_id = gimp_layer_new (image_id,
+                             layer_name.c_str(),
+                             width,
+                             height,
+                             type,
+                             100.0,
+                             GIMP_NORMAL_MODE);
   if (layer_id == -1)
     {
       error_msg = "failed to create layer";
@@ -90,37 +123,320 @@ static bool add_layer (const GimpImageType type,
       error_msg = "failed to add layer";
       return false;
     }
+  return true;
+}
+
+
+#if !GIMP_CHECK_VERSION (2, 10, 0)
+// Adds an empty layer to an existing GIMP image and prepares it for
+// receiving pixel data. The layer is new and its image not displayed yet,
+// so the pixels go straight into its tiles rather than into a shadow
+// buffer that is merged afterwards, unless shadow is set.
+//
+// @param[in]   type
+//  type of layer
+// @param[in]   width
+//  width of the layer in pixels
+// @param[in]   height
+//  height of the layer in pixels
+// @param[in]   image_id
+//  id of the image to which we add this layer
+// @param[out]  drawable
+//  drawable of the new layer, only valid when this function returns true;
+//  finish it with finish_layer()
+// @param[out]  pixel_region
+//  pixel region covering the whole layer
+// @param[in]   shadow
+//  write to the shadow tiles of the layer, see ConversionSettings
+// @param[out]  error_msg
+//  error message, only filled in when something went wrong
+// @return
+//  true on success, false on failure
+static bool add_layer (const GimpImageType type,
+                       const std::string   &layer_name,
+                       const size_t        width,
+                       const size_t        height,
+                       const gint32        image_id,
+                       GimpDrawable        **drawable,
+                       GimpPixelRgn        *pixel_region,
+                       const bool          shadow,
+                       std::string         &error_msg)
+{
+  gint32 layer_id = -1;
+  if (!insert_layer (type, layer_name, width, height, image_id, layer_id, error_msg))
+    {
+      return false;
+    }
 
-  GimpDrawable *drawable = gimp_drawable_get (layer_id);
-  if (!drawable)
+  *drawable = gimp_drawable_get (layer_id);
+  if (!*drawable)
     {
-      gimp_item_delete (layer_id); 
       error_msg = "failed to get drawable for layer";
       return false;
     }
 
-  GimpPixelRgn pixel_region;
-  gimp_pixel_rgn_init (&pixel_region,
-                       drawable,
+  gimp_pixel_rgn_init (pixel_region,
+                       *drawable,
                        0, 0,
                        width, height, 
                        TRUE,
-                       TRUE);
-  gimp_pixel_rgn_set_rect (&pixel_region,
-                           data,
-                           0,
-                           0,
-                           pixel_region.w,
-                           pixel_region.h);
+                       shadow);
+  return true;
+}
+
 
+// Commits the pixel data written to a layer created by add_layer() and
+// releases its drawable. Nothing displays the image yet, so there is no
+// need to update the layer, but for shadow tiles, which are merged and
+// updated like a filter does.
+//
+// @param[in]   drawable
+//  drawable of the layer
+// @param[in]   shadow
+//  the pixels went to the shadow tiles
+static void finish_layer (GimpDrawable *drawable,
+                          const bool   shadow)
+{
   gimp_drawable_flush (drawable);
-  gimp_drawable_merge_shadow (drawable->drawable_id, FALSE);
-  gimp_drawable_update (drawable->drawable_id,
-                        0, 0,
-                        width, height);
+  if (shadow)
+    {
+      gimp_drawable_merge_shadow (drawable->drawable_id, FALSE);
+      gimp_drawable_update (drawable->drawable_id,
+                            0, 0,
+                            drawable->width, drawable->height);
+    }
+  gimp_drawable_detach (drawable);
+}
+#endif
+
+
+// GIMP layer receiving converted rows. GIMP 2.10 and later take them
+// through the GEGL buffer of the layer, which also holds half and float
+// pixels; older versions through a pixel region.
+struct LayerTarget
+{
+  // id of the layer, -1 until it's created
+  gint32       m_layer_id;
+  // rows go to the shadow tiles of the layer
+  bool         m_shadow;
+  // legacy pixel region of the layer
+  GimpDrawable *m_drawable;
+  GimpPixelRgn m_region;
+#if GIMP_CHECK_VERSION (2, 10, 0)
+  // buffer of the layer and the format of the rows we write to it
+  GeglBuffer   *m_buffer;
+  const Babl   *m_format;
+#endif
+
+  // inits to no layer
+  LayerTarget();
+};
+
+
+inline LayerTarget::LayerTarget()
+:
+  m_layer_id (-1),
+  m_shadow (false),
+  m_drawable (NULL)
+#if GIMP_CHECK_VERSION (2, 10, 0)
+  ,
+  m_buffer (NULL),
+  m_format (NULL)
+#endif
+{}
+
+
+#if GIMP_CHECK_VERSION (2, 10, 0)
+// Returns the Babl format of rows for a GIMP layer: display encoded
+// (perceptual) for 8-bit and linear for half and float layers. Linear rows
+// with premultiplied alpha, as EXR stores it, get a premultiplied format so
+// babl divides by alpha when it writes them to the straight alpha layer.
+static const Babl *get_babl_format (const GimpImageType  type,
+                                    const ImagePrecision precision,
+                                    const bool           premultiplied)
+{
+  const bool  linear = precision != IMAGE_PRECISION_U8;
+  const bool  assoc  = linear && premultiplied;
+  std::string format;
+  switch (type)
+    {
+    case GIMP_GRAY_IMAGE : { format = linear ? "Y"   : "Y'";     break; }
+    case GIMP_GRAYA_IMAGE: { format = linear ? "YA"  : "Y'A";    break; }
+    case GIMP_RGB_IMAGE  : { format = linear ? "RGB" : "R'G'B'"; break; }
+    default              : { format = linear ? "RGBA" : "R'G'B'A"; break; }
+    }
+  if (assoc && type == GIMP_GRAYA_IMAGE)
+    {
+      format = "YaA";
+    }
+  else if (assoc && type == GIMP_RGBA_IMAGE)
+    {
+      format = "RaGaBaA";
+    }
+
+  switch (precision)
+    {
+    case IMAGE_PRECISION_HALF : { format += " half";  break; }
+    case IMAGE_PRECISION_FLOAT: { format += " float"; break; }
+    default                   : { format += " u8";    break; }
+    }
+  return babl_format (format.c_str());
+}
+#endif
+
+
+// Adds an empty layer to an existing GIMP image and gets it ready for the
+// rows.
+//
+// @param[out]  target
+//  layer to create, it gets the ids and handles of the new layer
+// @param[in]   type
+//  type of layer
+// @param[in]   layer_name
+//  name of the layer
+// @param[in]   precision
+//  precision of the image
+// @param[in]   premultiplied
+//  the linear rows written have premultiplied alpha, 8-bit rows are
+//  always straight
+// @param[in]   width, height
+//  size of the layer in pixels
+// @param[in]   image_id
+//  id of the image to which we add this layer
+// @param[in]   shadow
+//  write through the shadow tiles of the layer, see ConversionSettings
+// @param[out]  error_msg
+//  error message, only filled in when something went wrong
+// @return
+//  true on success, false on failure
+static bool open_layer (LayerTarget          &target,
+                        const GimpImageType  type,
+                        const std::string    &layer_name,
+                        const ImagePrecision precision,
+                        const bool           premultiplied,
+                        const size_t         width,
+                        const size_t         height,
+                        const gint32         image_id,
+                        const bool           shadow,
+                        std::string          &error_msg)
+{
+  target.m_shadow = shadow;
+#if GIMP_CHECK_VERSION (2, 10, 0)
+  if (!insert_layer (type,
+                     layer_name,
+                     width,
+                     height,
+                     image_id,
+                     target.m_layer_id,
+                     error_msg))
+    {
+      return false;
+    }
+
+  target.m_format = get_babl_format (type, precision, premultiplied);
+  target.m_buffer = shadow
+                    ? gimp_drawable_get_shadow_buffer (target.m_layer_id)
+                    : gimp_drawable_get_buffer (target.m_layer_id);
+  if (!target.m_buffer)
+    {
+      error_msg = "failed to get buffer for layer";
+      return false;
+    }
+  return true;
+#else
+  // 8-bit rows are straight already
+  (void)premultiplied;
+  if (precision != IMAGE_PRECISION_U8)
+    {
+      error_msg = "half and float images need GIMP 2.10 or later";
+      return false;
+    }
 
-  gimp_item_delete (drawable->drawable_id); 
+  if (!add_layer (type,
+                  layer_name,
+                  width,
+                  height,
+                  image_id,
+                  &target.m_drawable,
+                  &target.m_region,
+                  shadow,
+                  error_msg))
+    {
+      return false;
+    }
+  target.m_layer_id = target.m_drawable->drawable_id;
   return true;
+#endif
+}
+
+
+// Writes rows [y_begin, y_begin + rows) to a layer opened with
+// open_layer(). Bands that start and end on tile boundaries fill whole
+// tiles, so none of them has to be fetched before it's written.
+//
+// @param[in,out] target
+//  layer to write to
+// @param[in]   pixels
+//  the rows, packed in the format of the layer
+static void write_layer_rows (LayerTarget  &target,
+                              const guchar *pixels,
+                              const size_t y_begin,
+                              const size_t width,
+                              const size_t rows)
+{
+#if GIMP_CHECK_VERSION (2, 10, 0)
+  GeglRectangle rect;
+  rect.x      = 0;
+  rect.y      = y_begin;
+  rect.width  = width;
+  rect.height = rows;
+  gegl_buffer_set (target.m_buffer,
+                   &rect,
+                   0,
+                   target.m_format,
+                   pixels,
+                   GEGL_AUTO_ROWSTRIDE);
+#else
+  gimp_pixel_rgn_set_rect (&target.m_region,
+                           pixels,
+                           0,
+                           y_begin,
+                           width,
+                           rows);
+#endif
+}
+
+
+// Releases a layer opened with open_layer(). The rows written to it always
+// reach GIMP: a GEGL buffer of a layer flushes its tiles when released, and
+// so does a detached drawable. A failed conversion deletes the whole image
+// right after, which drops them again.
+static void close_layer (LayerTarget &target)
+{
+#if GIMP_CHECK_VERSION (2, 10, 0)
+  if (target.m_buffer)
+    {
+      // dropping the last reference flushes the buffer to the layer, the
+      // image isn't displayed yet so it needs no update; shadow tiles are
+      // merged and updated like a filter does
+      g_object_unref (target.m_buffer);
+      target.m_buffer = NULL;
+      if (target.m_shadow)
+        {
+          gimp_drawable_merge_shadow (target.m_layer_id, FALSE);
+          gimp_drawable_update (target.m_layer_id,
+                                0, 0,
+                                gimp_drawable_width (target.m_layer_id),
+                                gimp_drawable_height (target.m_layer_id));
+        }
+    }
+#else
+  if (target.m_drawable)
+    {
+      finish_layer (target.m_drawable, target.m_shadow);
+      target.m_drawable = NULL;
+    }
+#endif
 }
 
 
@@ -140,6 +456,8 @@ enum LayerType
   LAYER_TYPE_RGBA      = 5,
   // red, green and blue channel
   LAYER_TYPE_RGB       = 6,
+  // single integer channel, e.g. an object or material id pass
+  LAYER_TYPE_ID        = 7,
 };
 
 
@@ -150,6 +468,13 @@ static LayerType determine_layer_type (const exr::Layer &layer)
       return LAYER_TYPE_UNDEFINED;
     }
 
+  // id passes come under all sorts of names
+  if (layer.get_channel_count() == 1 &&
+      layer.get_channel_at(0)->get_pixel_data_type() == exr::PIXEL_DATA_TYPE_UINT)
+    {
+      return LAYER_TYPE_ID;
+    }
+
   // append and sort layer names
   std::string names = "";
   for (size_t i = 0; i < layer.get_channel_count(); ++i)
@@ -174,429 +499,1307 @@ static const char* layer_type_to_string (const LayerType type)
 {
   switch (type)
   {
-    LAYER_TYPE_UNDEFINED: { return "undefined"; }
-    LAYER_TYPE_Y        : { return "Y";         }
-    LAYER_TYPE_YC       : { return "YC";        }
-    LAYER_TYPE_YA       : { return "YA";        }
-    LAYER_TYPE_YCA      : { return "YCA";       }
-    LAYER_TYPE_RGBA     : { return "RGBA";      }
-    LAYER_TYPE_RGB      : { return "RGB";       }
-    default             : { return "unknown";   }
+    case LAYER_TYPE_UNDEFINED: { return "undefined"; }
+    case LAYER_TYPE_Y        : { return "Y";         }
+    case LAYER_TYPE_YC       : { return "YC";        }
+    case LAYER_TYPE_YA       : { return "YA";        }
+    case LAYER_TYPE_YCA      : { return "YCA";       }
+    case LAYER_TYPE_RGBA     : { return "RGBA";      }
+    case LAYER_TYPE_RGB      : { return "RGB";       }
+    case LAYER_TYPE_ID       : { return "ID";        }
+    default                  : { return "unknown";   }
   }
 }
 
 
-template<typename T>
-static inline T clamp (const T x,
-                       const T lo,
-                       const T hi)
+// Everything needed to convert an EXR layer and upload it to its GIMP layer,
+// set up once before the bands are processed.
+struct LayerPlan
 {
-  if (x < lo) { return lo; }
-  if (x > hi) { return hi; }
-  return x;
-}
+  // layer in the file
+  const exr::Layer            *m_layer;
+  // how we interpret the layer
+  LayerType                   m_type;
+  // type of the GIMP layer
+  GimpImageType               m_gimp_type;
+  // channels in the order GIMP expects them
+  std::vector<const Channel*> m_channels;
+  // loaders for the channels, set up once the first band is read
+  std::vector<ChannelInput>   m_input;
+  // true for id layers that are hashed to colours
+  bool                        m_hashed;
+  // bytes per 8-bit pixel of the GIMP layer
+  size_t                      m_bpp;
+  // local tone mapping of the layer, only used when it has been built
+  LocalToneMap                m_local_tone;
+  bool                        m_has_local_tone;
+  // GIMP layer being filled
+  LayerTarget                 m_target;
+};
 
 
-// Converts EXR HDR channels data to GIMP 8-bit LDR.
+// Works out how an EXR layer maps onto a GIMP layer.
 //
-// @param[in]   settings
-//    user-configured conversion settings
-// @param[in]   pixel_count
-//    number of pixels for the image - must be also the lenght of each channel
-//    data array
-// @param[in]   data_type
-//    data type the channels
-// @param[in]   input
-//    list with the raw data for each channel
-// @param[out]  output
-//    8-bit LDR image, it's up to the caller to delete[] this image afterwards
-static void convert_to_ldr(const ConversionSettings &settings,
-                           const size_t             pixel_count,
-                           const exr::PixelDataType data_type,
-                           std::vector<const char*> &input,
-                           guchar                   **output)
-{
-  const float  inv_gamma     = 1.0f / settings.m_gamma;
-  const float  exposure      = powf(2.f, settings.m_exposure + 2.47393f);
-  const size_t channel_count = input.size();
-  *output                    = new guchar[pixel_count * channel_count];
-
-  // copy over the pixels 
-  // TODO: do a proper HDR to LDR conversion
-  // TODO: vectorize this code
-  switch (data_type)
-    {
-    case exr::PIXEL_DATA_TYPE_FLOAT: 
-      {
-        for (size_t i = 0; i < pixel_count; ++i)
-          {
-            for (size_t j = 0; j < channel_count; ++j)
-              {
-                float val = ((float*)input[j])[i];
-                (*output)[channel_count * i + j] = clamp(val * 255.f, 0.f, 255.f);
-              }
-          }
-        break;
-      }
-    case exr::PIXEL_DATA_TYPE_HALF: 
-      {
-         for (size_t i = 0; i < pixel_count; ++i)
+// @param[in]   layer
+//  layer to convert
+// @param[in]   grayscale
+//  true when the GIMP image is grayscale
+// @param[in]   hash_ids
+//  true when id layers are hashed to colours
+// @param[out]  plan
+//  channels and GIMP layer type for the layer
+// @param[out]  error_msg
+//  error message, only filled in when something went wrong
+// @return
+//  true on success, false when the layer can't be converted
+static bool plan_layer (const exr::Layer *layer,
+                        const bool       grayscale,
+                        const bool       hash_ids,
+                        LayerPlan        &plan,
+                        std::string      &error_msg)
+{
+  const LayerType type = determine_layer_type (*layer);
+
+  plan.m_layer          = layer;
+  plan.m_type           = type;
+  plan.m_hashed         = type == LAYER_TYPE_ID && hash_ids;
+  plan.m_has_local_tone = false;
+  plan.m_channels.clear();
+
+  switch (type)
+    {
+      case LAYER_TYPE_RGBA:
+        {
+          plan.m_channels.push_back(layer->get_channel("R"));
+          plan.m_channels.push_back(layer->get_channel("G"));
+          plan.m_channels.push_back(layer->get_channel("B"));
+          plan.m_channels.push_back(layer->get_channel("A"));
+          plan.m_gimp_type = GIMP_RGBA_IMAGE;
+          break;
+        }
+      case LAYER_TYPE_RGB:
+        {
+          plan.m_channels.push_back(layer->get_channel("R"));
+          plan.m_channels.push_back(layer->get_channel("G"));
+          plan.m_channels.push_back(layer->get_channel("B"));
+          plan.m_gimp_type = GIMP_RGB_IMAGE;
+          break;
+        }
+      case LAYER_TYPE_ID:
+        {
+          if (hash_ids)
             {
-              for (size_t j = 0; j < channel_count; ++j)
-                {
-                  float val = ((half*)input[j])[i] * 1.f;
-                  (*output)[channel_count * i + j] = clamp(val * 255.f, 0.f, 255.f);
-                }
+              plan.m_channels.push_back(layer->get_channel_at(0));
+              plan.m_gimp_type = GIMP_RGB_IMAGE;
+              break;
             }
-         break;
-      }
-    case exr::PIXEL_DATA_TYPE_UINT: 
-      {
-         for (size_t i = 0; i < pixel_count; ++i)
+          // normalized ids are shown like luminance
+          const size_t copies = grayscale ? 1 : 3;
+          for (size_t j = 0; j < copies; ++j)
             {
-              for (size_t j = 0; j < channel_count; ++j)
-                {
-                  float val = ((unsigned int*)input[j])[i] * 1u;
-                  (*output)[channel_count * i + j] = clamp(val * 255.f, 0.f, 255.f);
-                }
+              plan.m_channels.push_back(layer->get_channel_at(0));
             }
-        break;
-      }
+          plan.m_gimp_type = grayscale ? GIMP_GRAY_IMAGE : GIMP_RGB_IMAGE;
+          break;
+        }
+      case LAYER_TYPE_Y:
+      case LAYER_TYPE_YA:
+        {
+          // luminance goes to all color channels in an RGB image
+          const size_t copies = grayscale ? 1 : 3;
+          for (size_t j = 0; j < copies; ++j)
+            {
+              plan.m_channels.push_back(layer->get_channel("Y"));
+            }
+          if (type == LAYER_TYPE_YA)
+            {
+              plan.m_channels.push_back(layer->get_channel("A"));
+              plan.m_gimp_type = grayscale ? GIMP_GRAYA_IMAGE : GIMP_RGBA_IMAGE;
+            }
+          else
+            {
+              plan.m_gimp_type = grayscale ? GIMP_GRAY_IMAGE : GIMP_RGB_IMAGE;
+            }
+          break;
+        }
+      case LAYER_TYPE_YC:
+      case LAYER_TYPE_YCA:
+        {
+          plan.m_channels.push_back(layer->get_channel("Y"));
+          plan.m_channels.push_back(layer->get_channel("RY"));
+          plan.m_channels.push_back(layer->get_channel("BY"));
+          const Channel *alpha_channel = NULL;
+          if (layer->find_channel("A", &alpha_channel))
+            {
+              plan.m_channels.push_back(alpha_channel);
+            }
+          plan.m_gimp_type = alpha_channel ? GIMP_RGBA_IMAGE : GIMP_RGB_IMAGE;
+          break;
+        }
+      case LAYER_TYPE_UNDEFINED:
+        {
+          error_msg = "not implemented: " 
+                      + std::string(layer_type_to_string (type));
+          return false;
+        }
     }
+
+  plan.m_bpp = plan.m_hashed ? 3 : plan.m_channels.size();
+  return true;
 }
 
 
-// Converts EXR luminance/chroma channels data to GIMP 8-bit LDR.
+// Picks the channels that make up the luminance of a layer.
 //
-// @param[in]   settings
-//    user-configured conversion settings
-// @param[in]   width
-//    width of the image in pixels
-// @param[in]   height
-//    height of the image in pixels
-// @param[in]   data_type
-//    data type the channels
-// @param[in]   input
-//    list with the raw data for each channel
-// @param[out]  output
-//    8-bit LDR image, it's up to the caller to delete[] this image afterwards
-static void chroma_to_ldr (const ConversionSettings &settings,
-                           const size_t             width,
-                           const size_t             height,
-                           const exr::PixelDataType data_type,
-                           std::vector<const char*> &input,
-                           guchar                   **output)
-{
-  const float  inv_gamma     = 1.0f / settings.m_gamma;
-  const float  exposure      = powf(2.f, settings.m_exposure + 2.47393f);
-  const size_t channel_count = input.size();
-  *output                    = new guchar[width * height * channel_count];
-
-  // copy over the pixels 
-  // TODO: do a proper HDR to LDR conversion
-  // TODO: vectorize this code
-  switch (data_type)
-    {
-    case exr::PIXEL_DATA_TYPE_FLOAT: 
-    case exr::PIXEL_DATA_TYPE_UINT: 
+// @param[in]   type
+//  type of the layer
+// @param[in]   layer_input
+//  inputs of the channels of the layer, see LayerPlan::m_input
+// @param[in]   yw
+//  luminance weights of the file's primaries
+// @param[out]  input, weights
+//  luminance channels and their weights
+// @return
+//  false for id layers, which have no luminance
+static bool get_luminance (const LayerType                 type,
+                           const std::vector<ChannelInput> &layer_input,
+                           const float                     yw[3],
+                           std::vector<ChannelInput>       &input,
+                           std::vector<float>              &weights)
+{
+  switch (type)
+    {
+      case LAYER_TYPE_RGB:
+      case LAYER_TYPE_RGBA:
+        {
+          input.assign (layer_input.begin(), layer_input.begin() + 3);
+          weights.assign (yw, yw + 3);
+          return true;
+        }
+      case LAYER_TYPE_Y:
+      case LAYER_TYPE_YA:
+      case LAYER_TYPE_YC:
+      case LAYER_TYPE_YCA:
+        {
+          input.assign (1, layer_input[0]);
+          weights.assign (1, 1.f);
+          return true;
+        }
+      default:
+        {
+          return false;
+        }
+    }
+}
+
+
+// Meters the exposure from the rows of a file as they are decoded, see
+// exr::BandObserver, so the luminance histogram takes no pass over the
+// image of its own.
+class ExposureMeter : public exr::BandObserver
+{
+public:
+
+  // Creates a meter counting into a histogram.
+  explicit ExposureMeter (LuminanceHistogram &histogram)
+  :
+    m_histogram (histogram)
+  {}
+
+  // Meters a layer too. Returns false when it can't be metered while
+  // decoding: layers without a luminance, and integer luminance channels,
+  // which are normalized by their range over the whole image.
+  bool add_layer (const LayerPlan &plan,
+                  const float     yw[3])
+  {
+    std::vector<ChannelInput> layer_input;
+    make_channel_inputs (plan.m_channels, layer_input, false);
+    Layer layer;
+    if (!get_luminance (plan.m_type, layer_input, yw, layer.m_input, layer.m_weights))
       {
-        const float *lum = (const float*)input[0];
-        const float *ry  = (const float*)input[1];
-        const float *rb  = (const float*)input[2];
-        const float *a   = channel_count > 3 ? (const float*)input[3] : NULL;
-        for (size_t y = 0; y < height; ++y)
-          {
-            for (size_t x = 0; x < width; ++x)
-              {
-                const size_t ix   = y * width + x;
-                const size_t six  = (y / 2) * width + (x / 2);
-                // get luminance/chroma and convert them to rgb color space
-                (*output)[channel_count * ix + 0] = clamp(lum[ix] * 255.f, 0.f, 255.f);
-                (*output)[channel_count * ix + 1] = clamp(ry[six] * 255.f, 0.f, 255.f);
-                (*output)[channel_count * ix + 2] = clamp(rb[six] * 255.f, 0.f, 255.f);
-                if (a)
-                  {
-                    (*output)[channel_count * ix + 3] = clamp(a[ix] * 255.f, 0.f, 255.f);
-                  }
-              }
-            }
-        break;
+        return false;
       }
-    case exr::PIXEL_DATA_TYPE_HALF: 
+    for (size_t j = 0; j < layer.m_input.size(); ++j)
       {
-        const half *lum = (const half*)input[0];
-        const half *ry  = (const half*)input[1];
-        const half *rb  = (const half*)input[2];
-        const half *a   = channel_count > 3 ? (const half*)input[3] : NULL;
-        for (size_t y = 0; y < height; ++y)
+        if (layer.m_input[j].m_channel->get_pixel_data_type() == exr::PIXEL_DATA_TYPE_UINT)
           {
-            for (size_t x = 0; x < width; ++x)
-              {
-                const size_t ix   = y * width + x;
-                const size_t six  = (y / 2) * width + (x / 2);
-                // get luminance/chroma and convert them to rgb color space
-                (*output)[channel_count * ix + 0] = clamp(lum[ix] * 255.f, 0.f, 255.f);
-                (*output)[channel_count * ix + 1] = clamp(ry[six] * 255.f, 0.f, 255.f);
-                (*output)[channel_count * ix + 2] = clamp(rb[six] * 255.f, 0.f, 255.f);
-                if (a)
-                  {
-                    (*output)[channel_count * ix + 3] = clamp(a[ix] * 255.f, 0.f, 255.f);
-                  }
-              }
-            }
-         break;
+            return false;
+          }
       }
-    }
-}
+    m_layers.push_back (layer);
+    return true;
+  }
 
+  // Checks if any layer is metered.
+  bool is_metering () const
+  {
+    return !m_layers.empty();
+  }
 
-//-----------------------------------------------------------------------------
-// Implementation of Converter
+  virtual void band_decoded (const exr::File &file,
+                             const size_t    first_row,
+                             const size_t    row_count,
+                             const size_t    slot)
+  {
+    for (size_t i = 0; i < m_layers.size(); ++i)
+      {
+        Layer &layer = m_layers[i];
+        set_input_slot (layer.m_input, slot);
+        m_histogram.add_rows (layer.m_input,
+                              layer.m_weights,
+                              file.get_width(),
+                              first_row,
+                              first_row + row_count);
+      }
+  }
 
+private:
 
-Converter::Converter (const exr::File          &file,
-                      const ConversionSettings &settings)
-:
-  m_file (file),
-  m_settings (settings)
-{}
+  // luminance channels of a layer and their weights
+  struct Layer
+  {
+    std::vector<ChannelInput> m_input;
+    std::vector<float>        m_weights;
+  };
 
+  LuminanceHistogram &m_histogram;
+  std::vector<Layer> m_layers;
+};
 
-bool Converter::convert (gint32      &image_id,
-                         std::string &error_msg)
+
+// Read-only state shared by the row conversions of all layers.
+struct RowContext
 {
-  error_msg.clear();
+  // transform of color layers, with the view LUT if there is one
+  const DisplayTransform *m_transform;
+  // transform of gray layers (Y, YA and normalized ids), the view LUT is
+  // for color so they keep the transfer function
+  const DisplayTransform *m_gray_transform;
+  ImagePrecision         m_precision;
+  ChromaFilter           m_chroma_filter;
+  const float            *m_yw;
+  size_t                 m_width;
+  size_t                 m_height;
+};
 
-  // not much we can do if the file isn't in memory yet
-  if (!m_file.is_loaded())
+
+// Converts rows [y_begin, y_end) of a layer with the kernel for its type.
+//
+// @param[in]   plan
+//  layer to convert, its inputs must be set up
+// @param[in]   context
+//  shared conversion state
+// @param[in]   y_begin, y_end
+//  rows to convert, y_begin is even
+// @param[out]  output
+//  8-bit pixels, starting at row y_begin
+// @param[out]  mask
+//  non-finite mask starting at row y_begin, may be NULL
+// @param[in]   scratch
+//  get_chroma_scratch_size() floats for chroma layers, unused otherwise
+// @return
+//  number of pixels with non-finite samples
+static size_t convert_layer_rows (const LayerPlan  &plan,
+                                  const RowContext &context,
+                                  const size_t     y_begin,
+                                  const size_t     y_end,
+                                  guchar           *output,
+                                  guchar           *mask,
+                                  float            *scratch)
+{
+  const LocalToneMap *local = plan.m_has_local_tone ? &plan.m_local_tone : NULL;
+  if (plan.m_type == LAYER_TYPE_YC || plan.m_type == LAYER_TYPE_YCA)
     {
-      error_msg = "file not loaded in memory";
-      return false;
+      return chroma_rows (*context.m_transform,
+                          local,
+                          context.m_precision,
+                          context.m_chroma_filter,
+                          context.m_yw,
+                          context.m_width,
+                          context.m_height,
+                          y_begin,
+                          y_end,
+                          plan.m_input,
+                          output,
+                          mask,
+                          scratch);
     }
-
-  // check if all layers are grayscale, only then we can create
-  // a graycale image in the GIMP
-  bool grayscale = true;
-  for (size_t i = 0; i < m_file.get_layer_count(); ++i)
+  else if (plan.m_hashed)
     {
-      const LayerType layer_type = determine_layer_type (*m_file.get_layer_at(i));
-      if (layer_type != LAYER_TYPE_Y && layer_type != LAYER_TYPE_YA)
-        {
-          grayscale = false;
-          break;
-        }
+      id_rows (plan.m_input[0], context.m_width, y_begin, y_end, output);
+      return 0;
     }
-
-  // create GIMP image
-  if (!create_gimp_image (grayscale ? GIMP_GRAY : GIMP_RGB,
-                          m_file.get_width(),
-                          m_file.get_height(),
-                          image_id,
-                          error_msg))
+  else if (context.m_precision != IMAGE_PRECISION_U8)
     {
-      return false;
+      linear_rows (context.m_precision,
+                   plan.m_input,
+                   context.m_width,
+                   y_begin,
+                   y_end,
+                   output);
+      return 0;
     }
+  const bool gray = plan.m_type == LAYER_TYPE_Y  ||
+                    plan.m_type == LAYER_TYPE_YA ||
+                    plan.m_type == LAYER_TYPE_ID;
+  return convert_rows (gray ? *context.m_gray_transform : *context.m_transform,
+                       local,
+                       plan.m_input,
+                       context.m_width,
+                       y_begin,
+                       y_end,
+                       output,
+                       mask);
+}
 
-  // convert each layer individually 
-  for (size_t i = 0; i < m_file.get_layer_count(); ++i)
-    {
-      const Layer     *layer = m_file.get_layer_at(i);
-      const LayerType type   = determine_layer_type (*layer);
-      switch (type)
-        {
-          case LAYER_TYPE_RGBA:
-            {
-              std::vector<const char*> input;
-              input.push_back(layer->get_channel("R")->get_data());
-              input.push_back(layer->get_channel("G")->get_data());
-              input.push_back(layer->get_channel("B")->get_data());
-              input.push_back(layer->get_channel("A")->get_data());
-              
-              guchar *output = NULL;
-              convert_to_ldr (m_settings,
-                              m_file.get_width() * m_file.get_height(),
-                              layer->get_channel("R")->get_pixel_data_type(),
-                              input,
-                              &output);
-
-              if (!add_layer (GIMP_RGBA_IMAGE,
-                              layer->get_name(),
-                              m_file.get_width(),
-                              m_file.get_height(),
-                              image_id,
-                              output,
-                              error_msg))
-                {
-                  delete[] output;
-                  return false;
-                }
 
-              delete[] output;
-              break;
-            }
-          case LAYER_TYPE_RGB:
-            {
-              std::vector<const char*> input;
-              input.push_back(layer->get_channel("R")->get_data());
-              input.push_back(layer->get_channel("G")->get_data());
-              input.push_back(layer->get_channel("B")->get_data());
-              
-              guchar *output = NULL;
-              convert_to_ldr (m_settings,
-                              m_file.get_width() * m_file.get_height(),
-                              layer->get_channel("R")->get_pixel_data_type(),
-                              input,
-                              &output);
-
-              if (!add_layer (GIMP_RGB_IMAGE,
-                              layer->get_name(),
-                              m_file.get_width(),
-                              m_file.get_height(),
-                              image_id,
-                              output,
-                              error_msg))
-                {
-                  delete[] output;
-                  return false;
-                }
+// Converts a slice of rows of a layer on a thread of the global pool, and
+// posts a semaphore when it's done.
+class RowTask : public IlmThread::Task
+{
+public:
 
-              delete[] output;
-              break;
+  RowTask (IlmThread::TaskGroup *group,
+           const LayerPlan      &plan,
+           const RowContext     &context,
+           const size_t         y_begin,
+           const size_t         y_end,
+           guchar               *output,
+           guchar               *mask,
+           float                *scratch,
+           size_t               *non_finite_count,
+           IlmThread::Semaphore *finished)
+  :
+    IlmThread::Task (group),
+    m_plan (plan),
+    m_context (context),
+    m_y_begin (y_begin),
+    m_y_end (y_end),
+    m_output (output),
+    m_mask (mask),
+    m_scratch (scratch),
+    m_non_finite_count (non_finite_count),
+    m_finished (finished)
+  {}
 
-            }
-          case LAYER_TYPE_Y:
-            {
-              guchar *output = NULL;
-              if (grayscale)
-                {
-                  std::vector<const char*> input;
-                  input.push_back(layer->get_channel("Y")->get_data());
-
-                  convert_to_ldr (m_settings,
-                                  m_file.get_width() * m_file.get_height(),
-                                  layer->get_channel("Y")->get_pixel_data_type(),
-                                  input,
-                                  &output);
-                }
-              else
-                {
-                  std::vector<const char*> input;
-                  input.push_back(layer->get_channel("Y")->get_data());
-                  input.push_back(layer->get_channel("Y")->get_data());
-                  input.push_back(layer->get_channel("Y")->get_data());
-
-                  convert_to_ldr (m_settings,
-                                  m_file.get_width() * m_file.get_height(),
-                                  layer->get_channel("Y")->get_pixel_data_type(),
-                                  input,
-                                  &output);
-                }
+  virtual void execute()
+  {
+    *m_non_finite_count = convert_layer_rows (m_plan,
+                                              m_context,
+                                              m_y_begin,
+                                              m_y_end,
+                                              m_output,
+                                              m_mask,
+                                              m_scratch);
+    m_finished->post();
+  }
 
-              if (!add_layer (GIMP_GRAY_IMAGE,
-                              layer->get_name(),
-                              m_file.get_width(),
-                              m_file.get_height(),
-                              image_id,
-                              output,
-                              error_msg))
-                {
-                  delete[] output;
-                  return false;
-                }
+  // The pool deletes the tasks it ran, so their memory goes to a free list
+  // rather than back to the heap, and the tasks of later bands take it
+  // from there.
+  static void* operator new (size_t size);
+  static void operator delete (void *task);
 
-              delete[] output;
-              break;
+private:
+
+  const LayerPlan      &m_plan;
+  const RowContext     &m_context;
+  const size_t         m_y_begin;
+  const size_t         m_y_end;
+  guchar               *m_output;
+  guchar               *m_mask;
+  float                *m_scratch;
+  size_t               *m_non_finite_count;
+  IlmThread::Semaphore *m_finished;
+};
+
+
+// Memory of deleted RowTasks, each starting with a pointer to the next.
+// It's kept for the life of the plugin, at most a few tasks per thread.
+static IlmThread::Mutex row_task_mutex;
+static void             *row_task_free_list = NULL;
+
+
+void* RowTask::operator new (size_t size)
+{
+  {
+    IlmThread::Lock lock (row_task_mutex);
+    if (row_task_free_list)
+      {
+        void *task         = row_task_free_list;
+        row_task_free_list = *(void**)task;
+        return task;
+      }
+  }
+  return ::operator new (std::max (size, sizeof(void*)));
+}
+
+
+void RowTask::operator delete (void *task)
+{
+  if (!task)
+    {
+      return;
+    }
+  IlmThread::Lock lock (row_task_mutex);
+  *(void**)task      = row_task_free_list;
+  row_task_free_list = task;
+}
+
+
+// Conversion of a band of a layer on the threads of OpenEXR's global pool,
+// which the plugin sizes to GIMP's number of processors. The main thread is
+// free to do something else, e.g. upload the previous band, until it needs
+// the result.
+//
+// A job is reused band after band: its task group, the slice counts and
+// the chroma scratch rows of the slices are set up by the first band and
+// only grow after that, and the tasks come from a free list, so starting
+// a band allocates nothing once the first one is done.
+class BandJob
+{
+public:
+
+  // Creates an idle job.
+  BandJob ();
+
+  // Waits for the conversion when it's still running.
+  ~BandJob ();
+
+  // Starts converting rows [y_begin, y_end) of a layer, split into slices
+  // of rows over the threads. Without threads the rows are converted right
+  // away. Same parameters as convert_layer_rows(), but for the scratch.
+  void start (const LayerPlan  &plan,
+              const RowContext &context,
+              const size_t     y_begin,
+              const size_t     y_end,
+              guchar           *output,
+              guchar           *mask);
+
+  // Waits for the conversion and returns the number of pixels with
+  // non-finite samples.
+  size_t finish ();
+
+private:
+
+  // Returns the scratch of slice k for layers of a given type, NULL when
+  // they don't need any. Grows the scratch of all slices when needed.
+  float* get_scratch (const LayerPlan  &plan,
+                      const RowContext &context,
+                      const size_t     slice_count,
+                      const size_t     k);
+
+  // slices started and not waited for yet
+  size_t               m_running;
+  // posted by each slice when it's done
+  IlmThread::Semaphore m_finished;
+  // non-finite pixels per slice
+  std::vector<size_t>  m_counts;
+  // chroma scratch rows of the slices
+  AlignedBuffer        m_scratch;
+  // group of the tasks of all bands, destroyed first, which waits for the
+  // last tasks to be let go by the pool
+  IlmThread::TaskGroup m_group;
+
+  // not copyable
+  BandJob (const BandJob&);
+  BandJob& operator= (const BandJob&);
+};
+
+
+BandJob::BandJob ()
+:
+  m_running (0),
+  m_finished (0)
+{}
+
+
+BandJob::~BandJob ()
+{
+  finish ();
+}
+
+
+float* BandJob::get_scratch (const LayerPlan  &plan,
+                             const RowContext &context,
+                             const size_t     slice_count,
+                             const size_t     k)
+{
+  if (plan.m_type != LAYER_TYPE_YC && plan.m_type != LAYER_TYPE_YCA)
+    {
+      return NULL;
+    }
+  const size_t slice_bytes = align_size (get_chroma_scratch_size (context.m_width) * sizeof(float));
+  m_scratch.reserve (slice_count * slice_bytes);
+  return (float*)(m_scratch.get() + k * slice_bytes);
+}
+
+
+void BandJob::start (const LayerPlan  &plan,
+                     const RowContext &context,
+                     const size_t     y_begin,
+                     const size_t     y_end,
+                     guchar           *output,
+                     guchar           *mask)
+{
+  finish ();
+
+  const size_t threads = IlmThread::ThreadPool::globalThreadPool().numThreads();
+  const size_t rows    = y_end - y_begin;
+  if (threads < 2 || rows < 4)
+    {
+      float *scratch = get_scratch (plan, context, 1, 0);
+      m_counts.assign (1, convert_layer_rows (plan, context, y_begin, y_end, output, mask, scratch));
+      return;
+    }
+
+  // a couple of slices per thread to even out the load; slices start on
+  // even rows so chroma rows are never split
+  size_t slice = (rows + 2 * threads - 1) / (2 * threads);
+  slice        = std::max (slice + slice % 2, (size_t)2);
+
+  const size_t row_bytes = context.m_width * plan.m_bpp;
+  const size_t count     = (rows + slice - 1) / slice;
+  m_counts.assign (count, 0);
+  for (size_t k = 0; k < count; ++k)
+    {
+      const size_t begin = y_begin + k * slice;
+      const size_t end   = std::min (begin + slice, y_end);
+      IlmThread::ThreadPool::addGlobalTask (
+          new RowTask (&m_group,
+                       plan,
+                       context,
+                       begin,
+                       end,
+                       output + (begin - y_begin) * row_bytes,
+                       mask ? mask + (begin - y_begin) * context.m_width : NULL,
+                       get_scratch (plan, context, count, k),
+                       &m_counts[k],
+                       &m_finished));
+      ++m_running;
+    }
+}
+
+
+size_t BandJob::finish ()
+{
+  for (; m_running > 0; --m_running)
+    {
+      m_finished.wait();
+    }
+
+  size_t count = 0;
+  for (size_t k = 0; k < m_counts.size(); ++k)
+    {
+      count += m_counts[k];
+    }
+  m_counts.clear();
+  return count;
+}
+
+
+// Most layers of a band converted at once, each on all threads of the
+// pool, while the main thread uploads the one before them.
+static const size_t MAX_LAYERS_IN_FLIGHT = 4;
+
+
+// Cap on the output buffers of the layers in flight, in bytes. Wide images
+// get fewer layers in flight.
+static const size_t IN_FLIGHT_BYTES = 32 * 1024 * 1024;
+
+
+// Rows of a layer converted and waiting to be written to GIMP.
+struct BandUpload
+{
+  LayerTarget  *m_target;
+  const guchar *m_pixels;
+  size_t       m_y_begin;
+  size_t       m_rows;
+};
+
+
+// Writes the rows of a pending upload, if any, and clears it. The time it
+// took is added to upload_time, in microseconds.
+static void flush_upload (BandUpload   &upload,
+                          const size_t width,
+                          gint64       &upload_time)
+{
+  if (upload.m_target)
+    {
+      const gint64 start = g_get_monotonic_time ();
+      write_layer_rows (*upload.m_target,
+                        upload.m_pixels,
+                        upload.m_y_begin,
+                        width,
+                        upload.m_rows);
+      upload_time += g_get_monotonic_time () - start;
+      upload.m_target = NULL;
+    }
+}
+
+
+
+// Smallest step of GIMP's progress bar, smaller steps aren't worth a call.
+static const double PROGRESS_STEP = 0.01;
+
+
+// Time between two looks at the progress of a file decoded up front, in
+// microseconds.
+static const gulong LOAD_POLL_INTERVAL = 20000;
+
+
+// Shows the progress of a load in GIMP. The workers only count rows, this
+// runs on the thread of the conversion, the only one that calls GIMP while
+// it runs, at the end of each band. Only reports: GIMP's Cancel ends the plug-in process rather
+// than telling it, loads are cancelled through their LoadProgress.
+class ProgressReport
+{
+public:
+
+  explicit ProgressReport (LoadProgress *progress)
+  :
+    m_progress (progress),
+    m_reported (0.0)
+  {}
+
+  // Updates GIMP's progress bar when it moved a step.
+  void update ()
+  {
+    if (!m_progress)
+      {
+        return;
+      }
+    const double fraction = m_progress->get_fraction();
+    if (fraction - m_reported < PROGRESS_STEP && fraction < 1.0)
+      {
+        return;
+      }
+    m_reported = fraction;
+    gimp_progress_update (fraction);
+  }
+
+private:
+
+  LoadProgress *m_progress;
+  double       m_reported;
+};
+
+
+// Decodes all rows of an open file. The decoding runs on a thread of its
+// own, so the main thread keeps GIMP's progress moving meanwhile.
+static bool load_file (exr::File      &file,
+                       ProgressReport &report,
+                       std::string    &error_msg)
+{
+  if (!IlmThread::supportsThreads())
+    {
+      return file.load (error_msg);
+    }
+
+  exr::LoadFuture *load = file.load_async();
+  while (!load->is_done())
+    {
+      report.update();
+      g_usleep (LOAD_POLL_INTERVAL);
+    }
+  const bool success = load->wait (error_msg);
+  delete load;
+  report.update();
+  return success;
+}
+
+
+// Reads all rows of a file a band at a time to gather the statistics of its
+// channels, without keeping the pixels, and reports the progress after each
+// band.
+static bool read_statistics (exr::File      &file,
+                             const size_t   band_rows,
+                             ProgressReport &report,
+                             std::string    &error_msg)
+{
+  const size_t height  = file.get_height();
+  bool         success = true;
+  file.set_gather_statistics (true);
+  for (size_t y = 0; y < height && success; y += band_rows)
+    {
+      success = file.read_rows (y, std::min (band_rows, height - y), error_msg);
+      report.update();
+    }
+  file.set_gather_statistics (false);
+  return success;
+}
+
+
+//-----------------------------------------------------------------------------
+// Implementation of Converter
+
+
+Converter::Converter (exr::File                &file,
+                      const ConversionSettings &settings)
+:
+  m_file (file),
+  m_settings (settings),
+  m_non_finite_count (0),
+  m_upload_time (0)
+{}
+
+
+bool Converter::convert (gint32      &image_id,
+                         std::string &error_msg)
+{
+  return convert (image_id, error_msg, true);
+}
+
+
+bool Converter::convert (gint32      &image_id,
+                         std::string &error_msg,
+                         const bool  report_progress)
+{
+  error_msg.clear();
+  m_non_finite_count = 0;
+  m_upload_time      = 0;
+
+  // not much we can do if the file isn't open yet
+  if (!m_file.is_open())
+    {
+      error_msg = "file not open";
+      return false;
+    }
+
+  // high precision images get the linear values of the file as they are,
+  // without the display transform and its companions
+  const ImagePrecision precision = m_settings.m_precision;
+  const bool           linear    = precision != IMAGE_PRECISION_U8;
+
+  // id layers are hashed to colours or shown as normalized grayscale, the
+  // colours are display values so high precision images get the latter
+  const bool hash_ids = m_settings.m_uint_mapping == UINT_MAPPING_HASH && !linear;
+
+  // check if all layers are grayscale, only then we can create
+  // a graycale image in the GIMP
+  bool grayscale = true;
+  for (size_t i = 0; i < m_file.get_layer_count(); ++i)
+    {
+      const LayerType layer_type = determine_layer_type (*m_file.get_layer_at(i));
+      if (layer_type != LAYER_TYPE_Y && layer_type != LAYER_TYPE_YA &&
+          (layer_type != LAYER_TYPE_ID || hash_ids))
+        {
+          grayscale = false;
+          break;
+        }
+    }
+
+  // work out the conversion of each layer before touching any pixels
+  std::vector<LayerPlan> plans (m_file.get_layer_count());
+  bool has_chroma = false;
+  // the local tone maps and the exposure are worked out from the whole
+  // image before converting, so these decode it up front
+  const bool local_tone_mapping = m_settings.m_local_tone_mapping && !linear;
+  const bool auto_exposure      = m_settings.m_auto_exposure && !linear;
+  bool       full_frame         = local_tone_mapping || auto_exposure;
+  bool       scan_statistics    = false;
+  for (size_t i = 0; i < plans.size(); ++i)
+    {
+      LayerPlan &plan = plans[i];
+      if (!plan_layer (m_file.get_layer_at(i), grayscale, hash_ids, plan, error_msg))
+        {
+          return false;
+        }
+      has_chroma |= plan.m_type == LAYER_TYPE_YC || plan.m_type == LAYER_TYPE_YCA;
+      plan.m_bpp *= get_sample_size (precision);
+
+      // integer channels are normalized by their range over the whole image
+      if (!plan.m_hashed)
+        {
+          for (size_t j = 0; j < plan.m_channels.size(); ++j)
+            {
+              scan_statistics |= plan.m_channels[j]->get_pixel_data_type() == exr::PIXEL_DATA_TYPE_UINT;
             }
-          case LAYER_TYPE_YA:
+        }
+    }
+  // a streamed image only knows that range from a pass over the file that
+  // keeps nothing but the channel statistics, the pixels of a loaded one
+  // are scanned instead
+  scan_statistics = scan_statistics && !full_frame && !m_file.is_loaded();
+
+  // the view LUT, if any, is read before we create anything in GIMP
+  Lut3D lut;
+  if (!m_settings.m_lut_path.empty() && !linear)
+    {
+      if (!lut.load (m_settings.m_lut_path, error_msg))
+        {
+          return false;
+        }
+      lut.set_shaper (m_settings.m_lut_shaper,
+                      m_settings.m_lut_min_stops,
+                      m_settings.m_lut_max_stops);
+    }
+
+  const size_t width     = m_file.get_width();
+  const size_t height    = m_file.get_height();
+
+  // rows to convert, plus the rows the decoder thread decodes while
+  // streaming and those of the statistics pass; loading the file up front
+  // counts its rows itself
+  LoadProgress   *progress = m_file.get_progress();
+  ProgressReport report (report_progress ? progress : NULL);
+  if (progress)
+    {
+      progress->expect ((m_file.is_loaded() || full_frame ? height : 2 * height) +
+                        (scan_statistics ? height : 0));
+    }
+  // images that are decoded up front are still converted and uploaded a
+  // band at a time, so the pixels in the layer format never take more than
+  // a band of tile rows
+  const size_t band_rows = std::min (choose_band_rows (m_file, gimp_tile_height()), height);
+
+  const exr::Chromaticities &chromaticities = m_file.get_chromaticities();
+  float yw[3];
+  chromaticities.get_luminance_weights (yw);
+
+  // the exposure has to be known before the first row is converted, so it
+  // is metered from the bands as the one decode of the image goes by, next
+  // to the channel statistics. The local tone maps count the histogram as
+  // they go instead.
+  LuminanceHistogram histogram;
+  ExposureMeter      meter (histogram);
+  std::vector<bool>  metered (plans.size(), false);
+  if (auto_exposure && !local_tone_mapping && !m_file.is_loaded())
+    {
+      for (size_t i = 0; i < plans.size(); ++i)
+        {
+          metered[i] = !plans[i].m_hashed && meter.add_layer (plans[i], yw);
+        }
+    }
+
+  if (scan_statistics && !read_statistics (m_file, band_rows, report, error_msg))
+    {
+      return false;
+    }
+
+  // full-frame conversions decode the whole image before anything else,
+  // the luminance of the layers is analyzed while it's still warm
+  ConversionSettings settings = m_settings;
+  if (full_frame)
+    {
+      if (!m_file.is_loaded())
+        {
+          m_file.set_band_observer (meter.is_metering() ? &meter : NULL);
+          const bool success = load_file (m_file, report, error_msg);
+          m_file.set_band_observer (NULL);
+          if (!success)
             {
-              guchar *output = NULL;
-              if (grayscale)
-                {
-                  std::vector<const char*> input;
-                  input.push_back(layer->get_channel("Y")->get_data());
-                  input.push_back(layer->get_channel("A")->get_data());
-
-                  convert_to_ldr (m_settings,
-                                  m_file.get_width() * m_file.get_height(),
-                                  layer->get_channel("Y")->get_pixel_data_type(),
-                                  input,
-                                  &output);
-                }
-              else
-                {
-                  std::vector<const char*> input;
-                  input.push_back(layer->get_channel("Y")->get_data());
-                  input.push_back(layer->get_channel("Y")->get_data());
-                  input.push_back(layer->get_channel("Y")->get_data());
-                  input.push_back(layer->get_channel("A")->get_data());
-
-                  convert_to_ldr (m_settings,
-                                  m_file.get_width() * m_file.get_height(),
-                                  layer->get_channel("Y")->get_pixel_data_type(),
-                                  input,
-                                  &output);
-                }
+              return false;
+            }
+        }
 
-              if (!add_layer (GIMP_GRAYA_IMAGE,
-                              layer->get_name(),
-                              m_file.get_width(),
-                              m_file.get_height(),
-                              image_id,
-                              output,
-                              error_msg))
-                {
-                  delete[] output;
-                  return false;
-                }
+      std::vector<ChannelInput> luminance;
+      std::vector<float>        weights;
+      for (size_t i = 0; i < plans.size(); ++i)
+        {
+          LayerPlan &plan = plans[i];
+          if (plan.m_hashed)
+            {
+              continue;
+            }
+          make_channel_inputs (plan.m_channels, plan.m_input);
+          if (!get_luminance (plan.m_type, plan.m_input, yw, luminance, weights))
+            {
+              continue;
+            }
 
-              delete[] output;
-              break;
+          if (local_tone_mapping)
+            {
+              plan.m_local_tone.build (luminance,
+                                       weights,
+                                       yw,
+                                       width,
+                                       height,
+                                       m_settings,
+                                       auto_exposure ? &histogram : NULL);
+              plan.m_has_local_tone = true;
+            }
+          else if (auto_exposure && !metered[i])
+            {
+              // a loaded file or integer luminance, metered on its own
+              histogram.add_image (luminance, weights, width, height);
+            }
+        }
+    }
+
+  // the percentile is exposed to 1, m_exposure compensates on top
+  if (auto_exposure)
+    {
+      settings.m_exposure -= histogram.get_percentile (m_settings.m_auto_exposure_percentile);
+    }
+
+  // nothing was made in GIMP yet, so a cancelled load has nothing to undo
+  if (progress && progress->is_cancelled())
+    {
+      error_msg = "loading cancelled";
+      return false;
+    }
+
+  // create GIMP image
+  if (!create_gimp_image (grayscale ? GIMP_GRAY : GIMP_RGB,
+                          precision,
+                          width,
+                          height,
+                          image_id,
+                          error_msg))
+    {
+      return false;
+    }
+
+  // building the image needs no undo history, every step would otherwise
+  // keep a copy of the tiles it touches
+  gimp_image_undo_disable (image_id);
+
+  // create the GIMP layers up front, the bands are written to all of them
+  for (size_t i = 0; i < plans.size(); ++i)
+    {
+      LayerPlan &plan = plans[i];
+      if (!open_layer (plan.m_target,
+                       plan.m_gimp_type,
+                       plan.m_layer->get_name(),
+                       precision,
+                       m_settings.m_unpremultiply,
+                       width,
+                       height,
+                       image_id,
+                       m_settings.m_shadow_upload,
+                       error_msg))
+        {
+          for (size_t j = 0; j <= i; ++j)
+            {
+              close_layer (plans[j].m_target);
+            }
+          gimp_image_delete (image_id);
+          image_id = -1;
+          return false;
+        }
+    }
+
+  // optional layer on top that marks the pixels with NaN or infinite
+  // samples, opaque white (grayscale) or red over transparent; high
+  // precision images keep those samples as they are
+  const bool   has_mask = m_settings.m_non_finite_mask && !linear;
+  const size_t mask_bpp = grayscale ? 2 : 4;
+  LayerTarget  mask_target;
+  if (has_mask &&
+      !open_layer (mask_target,
+                   grayscale ? GIMP_GRAYA_IMAGE : GIMP_RGBA_IMAGE,
+                   "non-finite pixels",
+                   precision,
+                   false,
+                   width,
+                   height,
+                   image_id,
+                   m_settings.m_shadow_upload,
+                   error_msg))
+    {
+      close_layer (mask_target);
+      for (size_t j = 0; j < plans.size(); ++j)
+        {
+          close_layer (plans[j].m_target);
+        }
+      gimp_image_delete (image_id);
+      image_id = -1;
+      return false;
+    }
+
+  // keep a row of tiles of each layer in the cache, each band writes to
+  // all of them
+  const size_t layer_count = plans.size() + (has_mask ? 1 : 0);
+  gimp_tile_cache_ntiles (layer_count * (width / gimp_tile_width() + 1));
+
+  // decode, convert and upload the image a band of tile rows at a time,
+  // so the data is still in cache when the next step touches it; one band
+  // buffer is reused by all layers
+  const DisplayTransform transform (settings,
+                                    chromaticities,
+                                    lut.get_size() ? &lut : NULL);
+  const DisplayTransform gray_transform (settings, chromaticities);
+  RowContext             context;
+  context.m_transform      = &transform;
+  context.m_gray_transform = lut.get_size() ? &gray_transform : &transform;
+  context.m_precision      = precision;
+  context.m_chroma_filter  = m_settings.m_chroma_filter;
+  context.m_yw             = yw;
+  context.m_width          = width;
+  context.m_height         = height;
+
+  // while streaming the three steps overlap: a thread of its own decodes
+  // the next bands, the pool converts a few layers of the current band and
+  // the main thread, the only one that may call GIMP, uploads them in
+  // order. Each layer in flight has an output buffer and a mask of its own,
+  // plus one buffer for the upload, so memory stays fixed.
+  const bool   streaming  = !m_file.is_loaded() && !full_frame;
+  BandDecoder  *decoder   = streaming && IlmThread::supportsThreads()
+                            ? new BandDecoder (m_file, band_rows, has_chroma ? 1 : 0)
+                            : NULL;
+  const size_t band_bytes = align_size (band_rows * width * 4 * get_sample_size (precision));
+  const size_t in_flight  = std::max (std::min (std::min (IN_FLIGHT_BYTES / std::max (band_bytes, (size_t)1),
+                                                          MAX_LAYERS_IN_FLIGHT),
+                                                plans.size()),
+                                      (size_t)1);
+  const size_t mask_bytes = has_mask ? align_size (band_rows * width) : 0;
+  AlignedBuffer          output_buffer ((in_flight + 1) * band_bytes);
+  guchar                 *outputs = (guchar*)output_buffer.get();
+  size_t                 output_index = 0;
+  AlignedBuffer          mask_buffer ((in_flight + 1) * mask_bytes);
+  guchar                 *masks = (guchar*)mask_buffer.get();
+  guchar                 *band_mask = has_mask ? masks + in_flight * mask_bytes : NULL;
+  BandJob                jobs[MAX_LAYERS_IN_FLIGHT];
+  BandUpload             upload;
+  upload.m_target = NULL;
+  bool                   success = true;
+  for (size_t y_begin = 0; y_begin < height && success; y_begin += band_rows)
+    {
+      const size_t y_end = std::min (y_begin + band_rows, height);
+      const size_t rows  = y_end - y_begin;
+
+      if (progress && progress->is_cancelled())
+        {
+          error_msg = "loading cancelled";
+          success   = false;
+          break;
+        }
+
+      // bilinear chroma needs the first chroma row of the next band too
+      size_t slot = 0;
+      if (decoder)
+        {
+          success = decoder->take (slot, error_msg);
+        }
+      else if (streaming)
+        {
+          const size_t read_end = std::min (y_end + (has_chroma ? 1 : 0), height);
+          success = m_file.read_rows (y_begin, read_end - y_begin, error_msg);
+        }
+      if (!success)
+        {
+          break;
+        }
+
+      // no layer is being converted between bands, so the inputs can move
+      // to the slot of this one
+      for (size_t i = 0; i < plans.size(); ++i)
+        {
+          LayerPlan &plan = plans[i];
+          if (plan.m_input.empty())
+            {
+              // hashed ids need no range, that would be a pass of its own
+              make_channel_inputs (plan.m_channels, plan.m_input, !plan.m_hashed);
+            }
+          set_input_slot (plan.m_input, slot);
+        }
+      if (band_mask)
+        {
+          memset (masks, 0, (in_flight + 1) * mask_bytes);
+        }
+
+      // layer i goes to output buffer (first + i) % (in_flight + 1), so
+      // the buffer a new layer takes was uploaded the step before
+      const size_t first   = output_index;
+      size_t       started = 0;
+      for (size_t i = 0; i < plans.size(); ++i)
+        {
+          for (; started < plans.size() && started < i + in_flight; ++started)
+            {
+              const size_t k = started % in_flight;
+              jobs[k].start (plans[started],
+                             context,
+                             y_begin,
+                             y_end,
+                             outputs + (first + started) % (in_flight + 1) * band_bytes,
+                             band_mask ? masks + k * mask_bytes : NULL);
             }
-          case LAYER_TYPE_YC:
-          case LAYER_TYPE_YCA:
+
+          flush_upload (upload, width, m_upload_time);
+          const size_t k = i % in_flight;
+          m_non_finite_count += jobs[k].finish();
+          if (band_mask)
             {
-              std::vector<const char*> input;
-              input.push_back(layer->get_channel("Y")->get_data());
-              input.push_back(layer->get_channel("RY")->get_data());
-              input.push_back(layer->get_channel("BY")->get_data());
-              Channel *alpha_channel = NULL;
-              if (layer->find_channel("A", alpha_channel))
-              {
-                input.push_back(alpha_channel->get_data());
-              }
-
-              guchar *output = NULL;
-              chroma_to_ldr (m_settings,
-                             m_file.get_width(),
-                             m_file.get_height(),
-                             layer->get_channel("Y")->get_pixel_data_type(),
-                             input,
-                             &output);
-
-              if (!add_layer (GIMP_RGB_IMAGE,
-                              layer->get_name(),
-                              m_file.get_width(),
-                              m_file.get_height(),
-                              image_id,
-                              output,
-                              error_msg))
+              guchar *job_mask = masks + k * mask_bytes;
+              for (size_t j = 0; j < rows * width; ++j)
                 {
-                  delete[] output;
-                  return false;
+                  band_mask[j] |= job_mask[j];
                 }
-              break;
+              memset (job_mask, 0, mask_bytes);
             }
-          case LAYER_TYPE_UNDEFINED:
+
+          upload.m_target  = &plans[i].m_target;
+          upload.m_pixels  = outputs + (first + i) % (in_flight + 1) * band_bytes;
+          upload.m_y_begin = y_begin;
+          upload.m_rows    = rows;
+        }
+      output_index = (first + plans.size()) % (in_flight + 1);
+
+      if (decoder)
+        {
+          decoder->give_back();
+        }
+
+      if (band_mask)
+        {
+          flush_upload (upload, width, m_upload_time);
+          guchar *output = outputs + output_index * band_bytes;
+          output_index   = (output_index + 1) % (in_flight + 1);
+          for (size_t i = 0; i < rows * width; ++i)
             {
-              error_msg = "not implemented: " 
-                          + std::string(layer_type_to_string (type));
-              return false;
+              guchar *pixel = output + mask_bpp * i;
+              memset (pixel, band_mask[i] ? 255 : 0, mask_bpp);
+              if (mask_bpp == 4)
+                {
+                  pixel[1] = pixel[2] = 0;
+                }
             }
+
+          upload.m_target  = &mask_target;
+          upload.m_pixels  = output;
+          upload.m_y_begin = y_begin;
+          upload.m_rows    = rows;
+        }
+
+      if (progress)
+        {
+          progress->add (rows);
+          report.update();
+        }
+    }
+  if (success)
+    {
+      flush_upload (upload, width, m_upload_time);
+    }
+  delete decoder;
+
+  // releasing the layers flushes their last tiles to GIMP
+  const gint64 close_start = g_get_monotonic_time ();
+  for (size_t i = 0; i < plans.size(); ++i)
+    {
+      close_layer (plans[i].m_target);
+    }
+
+  if (has_mask)
+    {
+      const gint32 mask_id = mask_target.m_layer_id;
+      close_layer (mask_target);
+
+      // a clean image doesn't need the extra layer
+      if (success && m_non_finite_count == 0)
+        {
+          gimp_image_remove_layer (image_id, mask_id);
         }
     }
+  m_upload_time += g_get_monotonic_time () - close_start;
+
+  if (!success)
+    {
+      gimp_image_delete (image_id);
+      image_id = -1;
+      return false;
+    }
 
+  gimp_image_undo_enable (image_id);
   return true;
 }
 
 
+ConvertFuture* Converter::convert_async ()
+{
+  return new ConvertFuture (*this, m_file);
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Implementation of ConvertFuture
+
+
+ConvertFuture::ConvertFuture (Converter &converter,
+                              exr::File &file)
+:
+  m_converter (converter),
+  m_file (file),
+  m_progress (file.get_progress()),
+  m_success (false),
+  m_image_id (-1),
+  m_done (0),
+  m_worker (NULL)
+{
+  if (!m_progress)
+    {
+      m_progress = &m_own_progress;
+      m_file.set_progress (m_progress);
+    }
+  m_worker = new WorkerThread<ConvertFuture> (*this, &ConvertFuture::convert);
+}
+
+
+ConvertFuture::~ConvertFuture ()
+{
+  cancel ();
+  gint32      image_id;
+  std::string error_msg;
+  wait (image_id, error_msg);
+}
+
+
+double ConvertFuture::get_progress () const
+{
+  return m_progress->get_fraction();
+}
+
+
+bool ConvertFuture::is_done () const
+{
+  return g_atomic_int_get (&m_done) != 0;
+}
+
+
+void ConvertFuture::cancel ()
+{
+  if (!is_done())
+    {
+      m_progress->cancel();
+    }
+}
+
+
+bool ConvertFuture::wait (gint32      &image_id,
+                          std::string &error_msg)
+{
+  if (m_worker)
+    {
+      // the thread is gone after this, none of our members are touched
+      // any more
+      delete m_worker;
+      m_worker = NULL;
+
+      // the file outlives us, our own progress doesn't
+      if (m_file.get_progress() == &m_own_progress)
+        {
+          m_file.set_progress (NULL);
+        }
+    }
+  if (!m_success)
+    {
+      error_msg = m_error;
+      return false;
+    }
+  image_id = m_image_id;
+  return true;
+}
+
+
+void ConvertFuture::convert ()
+{
+  // whoever polls the future shows the progress
+  m_success = m_converter.convert (m_image_id, m_error, false);
+  g_atomic_int_set (&m_done, 1);
+}
+
+
+
 /* vim: set ts=2 sw=2 : */
@@ -3,27 +3,147 @@
 
 // system includes
 #include <string>
+// plugin includes
+#include "dither.hpp"
+#include "load_progress.hpp"
+#include "lut.hpp"
+#include "tone.hpp"
+#include "transfer.hpp"
+#include "worker_thread.hpp"
 
 namespace exr
 {
     class File;
 }
 
+class ConvertFuture;
+
+
+//-----------------------------------------------------------------------------
+// Filter used to upsample the chroma channels of luminance/chroma images.
+enum ChromaFilter
+{
+  // replicate each chroma sample over 2x2 pixels
+  CHROMA_FILTER_NEAREST  = 0,
+  // interpolate between neighbouring chroma samples
+  CHROMA_FILTER_BILINEAR = 1,
+};
+
+
+//-----------------------------------------------------------------------------
+// How integer (UINT) channels are mapped to displayable values.
+enum UintMapping
+{
+  // scale the observed range of the channel to black..white
+  UINT_MAPPING_NORMALIZE = 0,
+  // hash single-channel id layers to a distinct colour per id, other
+  // integer channels are normalized
+  UINT_MAPPING_HASH      = 1,
+};
+
+
+//-----------------------------------------------------------------------------
+// What to do with NaN and infinite samples in float and half channels.
+enum NonFinitePolicy
+{
+  // replace them by 0
+  NON_FINITE_POLICY_ZERO  = 0,
+  // NaN becomes 0, infinities become the largest float of the same sign so
+  // they still show up as white or black
+  NON_FINITE_POLICY_CLAMP = 1,
+};
+
+
+//-----------------------------------------------------------------------------
+// Precision of the GIMP image.
+enum ImagePrecision
+{
+  // 8-bit display values, made by the display transform
+  IMAGE_PRECISION_U8    = 0,
+  // linear half floats, the EXR values as they are (GIMP 2.10 and later)
+  IMAGE_PRECISION_HALF  = 1,
+  // linear floats, the EXR values as they are (GIMP 2.10 and later)
+  IMAGE_PRECISION_FLOAT = 2,
+};
+
+
+// Returns the size of a sample of the given precision in bytes.
+inline size_t get_sample_size (const ImagePrecision precision)
+{
+  switch (precision)
+    {
+    case IMAGE_PRECISION_HALF : { return 2; }
+    case IMAGE_PRECISION_FLOAT: { return 4; }
+    default                   : { return 1; }
+    }
+}
+
+
 
 //-----------------------------------------------------------------------------
 // Tracks the user-defined settings for doing the conversion.
 struct ConversionSettings
 {
-    // gamma correction factor
+    // precision of the GIMP image, the settings below only apply to 8-bit
+    // images, high precision images get the linear values
+    ImagePrecision m_precision;
+    // display encoding of the color channels
+    TransferFunction m_transfer_function;
+    // gamma correction factor, used by TRANSFER_FUNCTION_GAMMA
     float m_gamma;
-    // exposure of the image (stops)
+    // exposure of the image (stops), added to the metered exposure when
+    // m_auto_exposure is set
     float m_exposure; 
-    // 
+    // meter the exposure from a luminance histogram of the image
+    bool m_auto_exposure;
+    // fraction of the non-black pixels exposed to stay below 1
+    float m_auto_exposure_percentile;
+    // global tone mapping after exposure
+    ToneOperator m_tone_operator;
+    // Reinhard white point, the exposed value that maps to white
+    float m_reinhard_white;
+    // start of the knee of TONE_OPERATOR_KNEE (stops)
     float m_knee_low;
-    //
+    // end of the knee of TONE_OPERATOR_KNEE (stops)
     float m_knee_high;
-    // 
+    // flare removed by TONE_OPERATOR_KNEE before exposure
     float m_defog;
+    // chroma upsampling filter for luminance/chroma images
+    ChromaFilter m_chroma_filter;
+    // mapping of integer channels, e.g. object id passes
+    UintMapping m_uint_mapping;
+    // divide the premultiplied EXR colors by alpha, GIMP layers have
+    // straight alpha; applies to high precision images too
+    bool m_unpremultiply;
+    // replacement of NaN and infinite samples
+    NonFinitePolicy m_non_finite_policy;
+    // add a layer marking the pixels that had NaN or infinite samples
+    bool m_non_finite_mask;
+    // dithering when quantizing to 8 bits
+    DitherMethod m_dither_method;
+    // convert colors from the primaries of the file to sRGB
+    bool m_convert_primaries;
+    // .cube 3D LUT used as view transform for RGB layers instead of the
+    // transfer function, empty for none
+    std::string m_lut_path;
+    // how linear values are mapped onto the LUT input
+    LutShaper m_lut_shaper;
+    // range of the log2 shaper in stops around 18% gray
+    float m_lut_min_stops;
+    float m_lut_max_stops;
+    // write the layers through shadow tiles that are merged and updated
+    // afterwards, like a filter does. Slower, only there to time GIMP's
+    // upload paths against each other, see Converter::get_upload_time()
+    bool m_shadow_upload;
+    // compress the base layer of the luminance, keeping local detail
+    bool m_local_tone_mapping;
+    // contrast left in the base layer (stops)
+    float m_local_contrast;
+    // spatial extent of the base layer filter, as a fraction of the larger
+    // image dimension
+    float m_local_spatial_sigma;
+    // luminance differences (stops) the base layer filter keeps as edges
+    float m_local_range_sigma;
 
     // inits to default
     ConversionSettings();
@@ -32,11 +152,32 @@ struct ConversionSettings
 
 inline ConversionSettings::ConversionSettings()
 {
-    m_gamma     = 2.2f;
-    m_exposure  = 0.0f;
-    m_knee_low  = 0.0f;
-    m_knee_high = 5.0f;
-    m_defog     = 0.0f;
+    m_precision         = IMAGE_PRECISION_U8;
+    m_transfer_function = TRANSFER_FUNCTION_SRGB;
+    m_gamma             = 2.2f;
+    m_exposure          = 0.0f;
+    m_auto_exposure     = false;
+    m_auto_exposure_percentile = 0.95f;
+    m_tone_operator     = TONE_OPERATOR_NONE;
+    m_reinhard_white    = 4.0f;
+    m_knee_low          = 0.0f;
+    m_knee_high         = 5.0f;
+    m_defog             = 0.0f;
+    m_chroma_filter     = CHROMA_FILTER_BILINEAR;
+    m_uint_mapping      = UINT_MAPPING_HASH;
+    m_unpremultiply     = true;
+    m_non_finite_policy = NON_FINITE_POLICY_CLAMP;
+    m_non_finite_mask   = false;
+    m_dither_method     = DITHER_METHOD_NONE;
+    m_convert_primaries = true;
+    m_lut_shaper        = LUT_SHAPER_NONE;
+    m_lut_min_stops     = -6.5f;
+    m_lut_max_stops     = 6.5f;
+    m_shadow_upload     = false;
+    m_local_tone_mapping  = false;
+    m_local_contrast      = 5.0f;
+    m_local_spatial_sigma = 0.02f;
+    m_local_range_sigma   = 1.3f;
 }
 
 
@@ -49,10 +190,21 @@ class Converter
 public:
 
     // Creates a new converter.
-    Converter (const exr::File          &file,
+    Converter (exr::File                &file,
                const ConversionSettings &settings);
 
-    // Converts an EXR file into an 8-bit GIMP image.
+    // Converts an EXR file into a GIMP image. The file must be open;
+    // when it isn't loaded yet its pixels are decoded a band of rows at a
+    // time, on a thread of its own ahead of the conversion, so the whole
+    // image is never in memory. Converting a band overlaps with uploading
+    // the previous one to GIMP.
+    //
+    // When a progress is set on the file, the rows decoded and converted
+    // are counted in it, and cancelling it from another thread stops the
+    // conversion at the next band and deletes the partial image. The
+    // conversion itself runs on the calling thread, which is the one that
+    // talks to GIMP meanwhile; see convert_async() for one that returns
+    // right away.
     //
     // @param[out]  image_id
     //  Id of the freshly created image. Only valid when we return true.
@@ -63,12 +215,112 @@ public:
     bool convert (gint32      &image_id,
                   std::string &error_msg);
 
+    // Starts converting on a thread of its own and returns right away,
+    // see ConvertFuture. The conversion streams through the band pipeline
+    // just like convert(), and the calling thread must not talk to GIMP
+    // until it's done. The caller deletes the future, which cancels an
+    // unfinished conversion. The progress isn't shown in GIMP, whoever
+    // polls the future shows it.
+    ConvertFuture* convert_async ();
+
+    // Returns the number of pixels of the last conversion that had NaN or
+    // infinite samples, summed over all layers.
+    size_t get_non_finite_count() const;
+
+    // Returns the seconds the last conversion spent handing rows to GIMP,
+    // i.e. writing the layers and merging the shadow tiles.
+    double get_upload_time() const;
+
 protected:
 
+    friend class ConvertFuture;
+
+    // Same as above, but only shows the progress in GIMP when
+    // report_progress is set.
+    bool convert (gint32      &image_id,
+                  std::string &error_msg,
+                  const bool  report_progress);
+
     // file to convert
-    const exr::File          &m_file;
+    exr::File                &m_file;
     // conversion settings
     const ConversionSettings m_settings;
+    // pixels with non-finite samples found by the last conversion
+    size_t                   m_non_finite_count;
+    // microseconds spent uploading rows by the last conversion
+    gint64                   m_upload_time;
+};
+
+
+inline size_t Converter::get_non_finite_count() const
+{
+  return m_non_finite_count;
+}
+
+
+inline double Converter::get_upload_time() const
+{
+  return m_upload_time * 1e-6;
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Handle to a conversion running on a thread of its own, see
+// Converter::convert_async(). The rows are counted in the progress set on
+// the file, or in one of the future's own when there is none. Cancelling
+// stops the conversion at the next band and deletes the partial image, so
+// e.g. a dialog on the main thread can offer to stop a load.
+class ConvertFuture
+{
+public:
+
+    // Starts the conversion.
+    explicit ConvertFuture (Converter &converter,
+                            exr::File &file);
+
+    // Cancels the conversion unless it's done, and joins the thread.
+    ~ConvertFuture ();
+
+    // Returns the fraction of the rows decoded and converted so far.
+    double get_progress () const;
+
+    // Checks if the conversion is done, successfully or not, without
+    // waiting.
+    bool is_done () const;
+
+    // Asks the conversion to stop.
+    void cancel ();
+
+    // Waits for the conversion to be done and joins the thread.
+    //
+    // @param[out]  image_id
+    //  Id of the new image. Only valid when we return true.
+    // @param[out]  error_msg
+    //  Error message, only set when the conversion failed.
+    // @return
+    //  True on success, false when the conversion failed or was cancelled.
+    bool wait (gint32      &image_id,
+               std::string &error_msg);
+
+private:
+
+    // Converts, runs on the thread.
+    void convert ();
+
+    Converter                   &m_converter;
+    exr::File                   &m_file;
+    // progress of the file, or m_own_progress when it has none
+    LoadProgress                *m_progress;
+    LoadProgress                m_own_progress;
+    // outcome of the conversion, only read once the thread is joined
+    bool                        m_success;
+    gint32                      m_image_id;
+    std::string                 m_error;
+    // set when the conversion is done
+    volatile gint               m_done;
+    // thread converting, NULL once joined
+    WorkerThread<ConvertFuture> *m_worker;
 };
 
 
@@ -0,0 +1,61 @@
+#ifndef _DITHER_HPP_
+#define _DITHER_HPP_ 1
+
+// system includes
+#include <cstddef>
+
+
+//-----------------------------------------------------------------------------
+// Dithering applied when quantizing to 8 bits.
+enum DitherMethod
+{
+  // round to the nearest value
+  DITHER_METHOD_NONE       = 0,
+  // 8x8 Bayer matrix, cheap and regular
+  DITHER_METHOD_ORDERED    = 1,
+  // 64x64 blue noise tile, no visible pattern
+  DITHER_METHOD_BLUE_NOISE = 2,
+};
+
+
+// Width and height of a dither tile, patterns smaller than this are repeated
+// to fill it.
+static const size_t DITHER_TILE_SIZE = 64;
+
+
+//-----------------------------------------------------------------------------
+// Per pixel offsets, in 8-bit steps, added to values just before they are
+// rounded. The offset of a pixel only depends on its position modulo the
+// tile size, so rows can be converted in any order and on any thread and
+// still give the same result.
+class DitherPattern
+{
+public:
+
+  // Creates the pattern for a dither method.
+  DitherPattern (const DitherMethod method);
+
+  // Returns the DITHER_TILE_SIZE offsets in (-0.5, 0.5) for the pixels
+  // x % DITHER_TILE_SIZE of image row y, or NULL when not dithering.
+  const float* get_row (const size_t y) const;
+
+private:
+
+  // true when dithering
+  bool  m_enabled;
+  // the tile, row by row
+  float m_tile[DITHER_TILE_SIZE * DITHER_TILE_SIZE];
+};
+
+
+inline const float* DitherPattern::get_row (const size_t y) const
+{
+  return m_enabled ? m_tile + (y % DITHER_TILE_SIZE) * DITHER_TILE_SIZE : NULL;
+}
+
+
+
+#endif // #ifndef _DITHER_HPP_
+
+
+/* vim: set ts=2 sw=2 : */
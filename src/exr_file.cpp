@@ -1,16 +1,285 @@
 // C++ includes
 #include <algorithm>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
 // OpenEXR includes
+#include <half.h>
 #include "ImfChannelList.h"
+#include "ImfChromaticities.h"
 #include "ImfHeader.h"
 #include "ImfInputFile.h"
+#include "ImfStandardAttributes.h"
 #include "ImfTestFile.h"
+// plugin includes
+#include "load_future.hpp"
+#include "load_progress.hpp"
 // myself
 #include "exr_file.hpp"
 
 using namespace exr;
 
 
+//-----------------------------------------------------------------------------
+// Helpers
+
+
+// Bradford cone response matrix, used for chromatic adaptation.
+static const float BRADFORD[3][3] =
+{
+  {  0.8951f,  0.2664f, -0.1614f },
+  { -0.7502f,  1.7135f,  0.0367f },
+  {  0.0389f, -0.0685f,  1.0296f },
+};
+
+
+// Copies the 3x3 part of an Imath matrix, transposed: Imath multiplies row
+// vectors from the left, we use column vectors.
+static void from_imath (const Imath::M44f &in,
+                        float             out[3][3])
+{
+  for (int i = 0; i < 3; ++i)
+    {
+      for (int j = 0; j < 3; ++j)
+        {
+          out[i][j] = in[j][i];
+        }
+    }
+}
+
+
+// out = a * b, out may not alias a or b.
+static void multiply (const float a[3][3],
+                      const float b[3][3],
+                      float       out[3][3])
+{
+  for (int i = 0; i < 3; ++i)
+    {
+      for (int j = 0; j < 3; ++j)
+        {
+          out[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+        }
+    }
+}
+
+
+// Inverts a 3x3 matrix by its adjugate, the matrices here are far from
+// singular.
+static void invert (const float m[3][3],
+                    float       out[3][3])
+{
+  const float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+  const float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+  const float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+  const float det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+  const float inv = 1.f / det;
+
+  out[0][0] = c00 * inv;
+  out[1][0] = c01 * inv;
+  out[2][0] = c02 * inv;
+  out[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv;
+  out[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv;
+  out[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv;
+  out[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv;
+  out[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv;
+  out[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv;
+}
+
+
+// Converts our chromaticities to the OpenEXR ones.
+static Imf::Chromaticities to_imf_chromaticities (const Chromaticities &c)
+{
+  return Imf::Chromaticities (Imath::V2f (c.m_red[0],   c.m_red[1]),
+                              Imath::V2f (c.m_green[0], c.m_green[1]),
+                              Imath::V2f (c.m_blue[0],  c.m_blue[1]),
+                              Imath::V2f (c.m_white[0], c.m_white[1]));
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Implementation of Chromaticities
+
+
+void Chromaticities::get_luminance_weights (float yw[3]) const
+{
+  // the Y row of the RGB to XYZ matrix, same as Imf::RgbaYca::computeYw()
+  const Imath::M44f m = Imf::RGBtoXYZ (to_imf_chromaticities (*this), 1);
+  const float sum     = m[0][1] + m[1][1] + m[2][1];
+  yw[0]               = m[0][1] / sum;
+  yw[1]               = m[1][1] / sum;
+  yw[2]               = m[2][1] / sum;
+}
+
+
+bool Chromaticities::get_srgb_matrix (float m[3][3]) const
+{
+  // files written with 4-digit primaries should still count as Rec. 709
+  const Chromaticities srgb;
+  const float          *a = &m_red[0];
+  const float          *b = &srgb.m_red[0];
+  bool                 same = true;
+  for (int i = 0; i < 8; ++i)
+    {
+      same &= fabsf (a[i] - b[i]) < 1e-4f;
+    }
+  if (same)
+    {
+      return false;
+    }
+
+  float to_xyz[3][3], from_xyz[3][3];
+  from_imath (Imf::RGBtoXYZ (to_imf_chromaticities (*this), 1), to_xyz);
+  from_imath (Imf::XYZtoRGB (to_imf_chromaticities (srgb), 1), from_xyz);
+
+  // Bradford adaptation from our white to D65: scale the cone responses of
+  // the source white to those of the destination white
+  const float *sw           = m_white;
+  const float *dw           = srgb.m_white;
+  const float src_white[3]  = { sw[0] / sw[1], 1.f, (1.f - sw[0] - sw[1]) / sw[1] };
+  const float dst_white[3]  = { dw[0] / dw[1], 1.f, (1.f - dw[0] - dw[1]) / dw[1] };
+  float       scale[3][3]   = { { 0.f } };
+  for (int i = 0; i < 3; ++i)
+    {
+      const float src = BRADFORD[i][0] * src_white[0] +
+                        BRADFORD[i][1] * src_white[1] +
+                        BRADFORD[i][2] * src_white[2];
+      const float dst = BRADFORD[i][0] * dst_white[0] +
+                        BRADFORD[i][1] * dst_white[1] +
+                        BRADFORD[i][2] * dst_white[2];
+      scale[i][i]     = dst / src;
+    }
+  float inverse_bradford[3][3], cone[3][3], adapt[3][3], xyz[3][3];
+  invert (BRADFORD, inverse_bradford);
+  multiply (scale, BRADFORD, cone);
+  multiply (inverse_bradford, cone, adapt);
+
+  multiply (adapt, to_xyz, xyz);
+  multiply (from_xyz, xyz, m);
+  return true;
+}
+
+
+// Lanes of the statistics loops. Float sums and min/max don't vectorize as
+// plain reductions without -ffast-math, but independent lanes do.
+static const size_t STATISTICS_LANES = 8;
+
+
+// Samples of a half line converted at a time.
+static const size_t STATISTICS_CHUNK = 1024;
+
+
+// Adds a float sample to the statistics of one lane. The finite test (x - x
+// is 0 only for finite x) and the updates are selects, so the loops below
+// vectorize.
+static inline void gather_float (const float x,
+                                 float       &lo,
+                                 float       &hi,
+                                 float       &sum,
+                                 int         &nan,
+                                 int         &infinite)
+{
+  const bool  finite = x - x == 0.f;
+  const bool  is_nan = x != x;
+  const float low    = finite ? x : FLT_MAX;
+  const float high   = finite ? x : -FLT_MAX;
+  lo        = low < lo ? low : lo;
+  hi        = high > hi ? high : hi;
+  sum      += finite ? x : 0.f;
+  nan      += is_nan;
+  infinite += !finite && !is_nan;
+}
+
+
+// Adds n float samples to the statistics.
+static void gather_floats (const float       *samples,
+                           const size_t      n,
+                           ChannelStatistics &statistics)
+{
+  float lo[STATISTICS_LANES];
+  float hi[STATISTICS_LANES];
+  float sum[STATISTICS_LANES];
+  int   nan[STATISTICS_LANES];
+  int   infinite[STATISTICS_LANES];
+  for (size_t j = 0; j < STATISTICS_LANES; ++j)
+    {
+      lo[j]       = FLT_MAX;
+      hi[j]       = -FLT_MAX;
+      sum[j]      = 0.f;
+      nan[j]      = 0;
+      infinite[j] = 0;
+    }
+
+  const size_t blocks = n / STATISTICS_LANES * STATISTICS_LANES;
+  for (size_t i = 0; i < blocks; i += STATISTICS_LANES)
+    {
+      for (size_t j = 0; j < STATISTICS_LANES; ++j)
+        {
+          gather_float (samples[i + j], lo[j], hi[j], sum[j], nan[j], infinite[j]);
+        }
+    }
+  for (size_t j = 0; j < n - blocks; ++j)
+    {
+      gather_float (samples[blocks + j], lo[j], hi[j], sum[j], nan[j], infinite[j]);
+    }
+
+  for (size_t j = 0; j < STATISTICS_LANES; ++j)
+    {
+      statistics.m_min             = std::min (statistics.m_min, (double)lo[j]);
+      statistics.m_max             = std::max (statistics.m_max, (double)hi[j]);
+      statistics.m_sum            += sum[j];
+      statistics.m_nan_count      += nan[j];
+      statistics.m_infinity_count += infinite[j];
+    }
+  statistics.m_sample_count += n;
+}
+
+
+// Adds n half samples to the statistics, converted to float a chunk at a
+// time.
+static void gather_halves (const half        *samples,
+                           const size_t      n,
+                           ChannelStatistics &statistics)
+{
+  float buffer[STATISTICS_CHUNK];
+  for (size_t i = 0; i < n; i += STATISTICS_CHUNK)
+    {
+      const size_t count = std::min (STATISTICS_CHUNK, n - i);
+      for (size_t j = 0; j < count; ++j)
+        {
+          buffer[j] = samples[i + j];
+        }
+      gather_floats (buffer, count, statistics);
+    }
+}
+
+
+// Adds n unsigned int samples to the statistics, they're always finite.
+static void gather_uints (const unsigned int *samples,
+                          const size_t       n,
+                          ChannelStatistics  &statistics)
+{
+  unsigned int       lo  = UINT_MAX;
+  unsigned int       hi  = 0;
+  unsigned long long sum = 0;
+  for (size_t i = 0; i < n; ++i)
+    {
+      lo   = std::min (lo, samples[i]);
+      hi   = std::max (hi, samples[i]);
+      sum += samples[i];
+    }
+
+  if (n > 0)
+    {
+      statistics.m_min = std::min (statistics.m_min, (double)lo);
+      statistics.m_max = std::max (statistics.m_max, (double)hi);
+    }
+  statistics.m_sum          += (double)sum;
+  statistics.m_sample_count += n;
+}
+
+
+
 //-----------------------------------------------------------------------------
 // Implementation of Channel
 
@@ -18,21 +287,73 @@ using namespace exr;
 Channel::Channel(const std::string   &name,
                  const PixelDataType type,
                  const size_t        pixel_width,
-                 const size_t        pixel_height)
+                 const int           x_sampling,
+                 const int           y_sampling)
 :
   m_name(name),
   m_layer(NULL),
   m_pixel_data_type(type),
   m_x_stride(type == PIXEL_DATA_TYPE_HALF ? 2 : 4),
   m_y_stride(m_x_stride * pixel_width),
-  m_line_count(pixel_height),
-  m_buffer(new char[m_y_stride * m_line_count])
-{}
+  m_x_sampling(x_sampling),
+  m_y_sampling(y_sampling),
+  m_statistics_lines(0)
+{
+  for (size_t i = 0; i < ROW_SLOT_COUNT; ++i)
+    {
+      m_slots[i].m_first_row = 0;
+      m_slots[i].m_row_count = 0;
+    }
+}
  
 
 Channel::~Channel()
+{}
+
+
+void Channel::set_rows (const size_t first_row,
+                        const size_t row_count,
+                        const size_t slot)
 {
-  delete[] m_buffer;
+  RowSlot &rows = m_slots[slot];
+  rows.m_buffer.reserve (m_y_stride * get_line_count (row_count));
+  rows.m_first_row = first_row;
+  rows.m_row_count = row_count;
+}
+
+
+void Channel::gather_statistics (const size_t slot)
+{
+  const RowSlot &rows = m_slots[slot];
+
+  // subsampled lines hold a sample per x_sampling pixels
+  const size_t pixel_width = m_y_stride / m_x_stride;
+  const size_t samples     = (pixel_width + m_x_sampling - 1) / m_x_sampling;
+  const size_t first_line  = rows.m_first_row / m_y_sampling;
+  const size_t end_line    = first_line + get_line_count (rows.m_row_count);
+  for (size_t line = std::max (first_line, m_statistics_lines); line < end_line; ++line)
+    {
+      const char *data = rows.m_buffer.get() + (line - first_line) * m_y_stride;
+      switch (m_pixel_data_type)
+        {
+        case PIXEL_DATA_TYPE_FLOAT:
+          {
+            gather_floats ((const float*)data, samples, m_statistics);
+            break;
+          }
+        case PIXEL_DATA_TYPE_HALF:
+          {
+            gather_halves ((const half*)data, samples, m_statistics);
+            break;
+          }
+        case PIXEL_DATA_TYPE_UINT:
+          {
+            gather_uints ((const unsigned int*)data, samples, m_statistics);
+            break;
+          }
+        }
+    }
+  m_statistics_lines = std::max (m_statistics_lines, end_line);
 }
 
 
@@ -41,12 +362,56 @@ Channel::~Channel()
 // Implementation of File
 
 
+// Returns the number of scanlines OpenEXR stores in one compressed block.
+static size_t lines_per_block (const Imf::Header &header)
+{
+  if (header.hasTileDescription())
+    {
+      return header.tileDescription().ySize;
+    }
+
+  switch (header.compression())
+    {
+    case Imf::ZIP_COMPRESSION:
+    case Imf::PXR24_COMPRESSION:
+      return 16;
+    case Imf::PIZ_COMPRESSION:
+    case Imf::B44_COMPRESSION:
+    case Imf::B44A_COMPRESSION:
+    case Imf::DWAA_COMPRESSION:
+      return 32;
+    case Imf::DWAB_COMPRESSION:
+      return 256;
+    default:
+      return 1;
+    }
+}
+
+
+// Maps our pixel data type on the OpenEXR one.
+static Imf::PixelType to_imf_pixel_type (const PixelDataType type)
+{
+  switch (type)
+    {
+    case PIXEL_DATA_TYPE_UINT: { return Imf::UINT;  }
+    case PIXEL_DATA_TYPE_HALF: { return Imf::HALF;  }
+    default                  : { return Imf::FLOAT; }
+    }
+}
+
+
 File::File(const std::string &path)
 :
   m_loaded(false),
+  m_gather_statistics(false),
+  m_progress(NULL),
+  m_observer(NULL),
+  m_lines_per_block(1),
   m_path(path),
   m_width(0),
   m_height(0),
+  m_x_offset(0),
+  m_y_offset(0),
   m_handle(NULL)
 {}
 
@@ -65,6 +430,33 @@ File::~File()
 
 
 bool File::load(std::string &error_msg)
+{
+  if (!is_open() && !open (error_msg))
+    {
+      return false;
+    }
+
+  if (m_progress)
+    {
+      m_progress->expect (m_height);
+    }
+  if (!read_rows (0, m_height, error_msg))
+    {
+      return false;
+    }
+
+  m_loaded = true;
+  return true;
+}
+
+
+LoadFuture* File::load_async()
+{
+  return new LoadFuture (*this);
+}
+
+
+bool File::open(std::string &error_msg)
 {
   // don't bother if it's not an OpenEXR file
   if (!Imf::isOpenExrFile(get_path().c_str()))
@@ -84,9 +476,23 @@ bool File::load(std::string &error_msg)
       Imath::Box2i data_window  = header.dataWindow();
       m_width                   = data_window.max.x - data_window.min.x + 1;
       m_height                  = data_window.max.y - data_window.min.y + 1;
+      m_x_offset                = data_window.min.x;
+      m_y_offset                = data_window.min.y;
+      m_lines_per_block         = lines_per_block (header);
 
-      // stores pointers to the data to read out of the file
-      Imf::FrameBuffer frame_buffer;
+      // primaries, needed to reconstruct RGB from luminance/chroma
+      if (Imf::hasChromaticities (header))
+        {
+          const Imf::Chromaticities &c = Imf::chromaticities (header);
+          m_chromaticities.m_red[0]   = c.red.x;
+          m_chromaticities.m_red[1]   = c.red.y;
+          m_chromaticities.m_green[0] = c.green.x;
+          m_chromaticities.m_green[1] = c.green.y;
+          m_chromaticities.m_blue[0]  = c.blue.x;
+          m_chromaticities.m_blue[1]  = c.blue.y;
+          m_chromaticities.m_white[0] = c.white.x;
+          m_chromaticities.m_white[1] = c.white.y;
+        }
 
       // list of all the channels in the file
       const Imf::ChannelList &channel_list = header.channels();
@@ -108,7 +514,8 @@ bool File::load(std::string &error_msg)
               channel = new Channel (channel_name,
                                      PIXEL_DATA_TYPE_UINT,
                                      m_width,
-                                     m_height);
+                                     it.channel().xSampling,
+                                     it.channel().ySampling);
               break;
               }
             case Imf::FLOAT:
@@ -116,7 +523,8 @@ bool File::load(std::string &error_msg)
               channel = new Channel (channel_name,
                                      PIXEL_DATA_TYPE_FLOAT,
                                      m_width,
-                                     m_height);
+                                     it.channel().xSampling,
+                                     it.channel().ySampling);
               break;
               }
             case Imf::HALF:
@@ -124,7 +532,8 @@ bool File::load(std::string &error_msg)
               channel = new Channel (channel_name,
                                      PIXEL_DATA_TYPE_HALF,
                                      m_width,
-                                     m_height);
+                                     it.channel().xSampling,
+                                     it.channel().ySampling);
               break;
               }
             }
@@ -138,21 +547,107 @@ bool File::load(std::string &error_msg)
             }
           // track the channel
           layer->insert_channel (channel);
+        }
+    }
+  catch (std::exception &e)
+    {
+      error_msg = e.what();
+      return false;
+    }
+
+  return true;
+}
+
+
+bool File::read_rows(const size_t first_row,
+                     const size_t row_count,
+                     const size_t slot,
+                     std::string  &error_msg)
+{
+  if (!is_open())
+    {
+      error_msg = "file not open";
+      return false;
+    }
 
-          // register channels' buffer with fame buffer
-          frame_buffer.insert (it.name(),
-                               Imf::Slice (it.channel().type,
-                                           (char*)channel->get_data(),
-                                           channel->get_x_stride(),
-                                           channel->get_y_stride(),
-                                           it.channel().xSampling,
-                                           it.channel().ySampling,
-                                           0.f));
+  try
+    {
+      Imf::InputFile *file = (Imf::InputFile*)m_handle;
+
+      // stores pointers to the data to read out of the file
+      Imf::FrameBuffer frame_buffer;
+
+      for (size_t i = 0; i < m_layers.size(); ++i)
+        {
+          const Layer *layer = m_layers[i];
+          for (size_t j = 0; j < layer->get_channel_count(); ++j)
+            {
+              Channel *channel = (Channel*)layer->get_channel_at(j);
+              channel->set_rows (first_row, row_count, slot);
+
+              // OpenEXR addresses sample (x, y) of the data window at
+              // base + (x / xs) * x_stride + (y / ys) * y_stride, shift the
+              // base so the first row read lands at the start of the buffer
+              const int       xs   = channel->get_x_sampling();
+              const int       ys   = channel->get_y_sampling();
+              const ptrdiff_t line = (m_y_offset + (int)first_row) / ys;
+              const ptrdiff_t col  = m_x_offset / xs;
+              char *base = channel->m_slots[slot].m_buffer.get()
+                           - line * (ptrdiff_t)channel->get_y_stride()
+                           - col  * (ptrdiff_t)channel->get_x_stride();
+
+              // register channels' buffer with fame buffer
+              const std::string name = layer->get_name().empty()
+                                       ? channel->get_name()
+                                       : layer->get_name() + "." + channel->get_name();
+              frame_buffer.insert (name,
+                                   Imf::Slice (to_imf_pixel_type (channel->get_pixel_data_type()),
+                                               base,
+                                               channel->get_x_stride(),
+                                               channel->get_y_stride(),
+                                               xs,
+                                               ys,
+                                               0.f));
+            }
         }
 
-      // read out all the data in one sweep 
+      // read out the rows a chunk at a time, so a cancelled load stops
+      // soon, the progress moves along with the rows and the observer
+      // gets them while they are still in cache
       file->setFrameBuffer(frame_buffer);
-      file->readPixels(data_window.min.y, data_window.max.y);
+      const size_t chunk_rows = get_chunk_rows();
+      for (size_t y = first_row; y < first_row + row_count; y += chunk_rows)
+        {
+          if (m_progress && m_progress->is_cancelled())
+            {
+              error_msg = "loading cancelled";
+              return false;
+            }
+          const size_t rows = std::min (chunk_rows, first_row + row_count - y);
+          file->readPixels(m_y_offset + (int)y,
+                           m_y_offset + (int)(y + rows) - 1);
+          if (m_observer)
+            {
+              m_observer->band_decoded (*this, y, rows, slot);
+            }
+          if (m_progress)
+            {
+              m_progress->add (rows);
+            }
+        }
+
+      // the band was just decoded, so it's still in cache
+      if (m_gather_statistics)
+        {
+          for (size_t i = 0; i < m_layers.size(); ++i)
+            {
+              const Layer *layer = m_layers[i];
+              for (size_t j = 0; j < layer->get_channel_count(); ++j)
+                {
+                  ((Channel*)layer->get_channel_at(j))->gather_statistics (slot);
+                }
+            }
+        }
     }
   catch (std::exception &e)
     {
@@ -160,11 +655,37 @@ bool File::load(std::string &error_msg)
       return false;
     }
 
-  m_loaded = true;
   return true;
 }
 
 
+bool File::read_statistics(std::string &error_msg)
+{
+  const size_t band_rows = get_chunk_rows();
+  if (m_progress)
+    {
+      m_progress->expect (m_height);
+    }
+
+  const bool gather = m_gather_statistics;
+  m_gather_statistics = true;
+  bool success = true;
+  for (size_t y = 0; y < m_height && success; y += band_rows)
+    {
+      success = read_rows (y, std::min (band_rows, m_height - y), error_msg);
+    }
+  m_gather_statistics = gather;
+  return success;
+}
+
+
+size_t File::get_chunk_rows () const
+{
+  const size_t block = m_lines_per_block + m_lines_per_block % 2;
+  return std::max ((size_t)64 / block, (size_t)1) * block;
+}
+
+
 void File::split_full_channel_name (const std::string &input,
                                     std::string       &layer_name,
                                     std::string       &channel_name)
@@ -2,9 +2,14 @@
 #define _EXR_FILE_HPP_ 1
 
 // system includes
+#include <math.h>
 #include <map>
 #include <string>
 #include <vector>
+// plugin includes
+#include "aligned_buffer.hpp"
+
+class LoadProgress;
 
 
 namespace exr
@@ -13,6 +18,7 @@ namespace exr
 class Channel;
 class File;
 class Layer;
+class LoadFuture;
 
 
 enum PixelDataType
@@ -24,16 +30,138 @@ enum PixelDataType
 
 
 //-----------------------------------------------------------------------------
-// Wraps a data channel from the file in memory.
+// CIE x,y coordinates of the RGB primaries and white point of a file.
+struct Chromaticities
+{
+  float m_red[2];
+  float m_green[2];
+  float m_blue[2];
+  float m_white[2];
+
+  // inits to the Rec. ITU-R BT.709 primaries, the OpenEXR default
+  Chromaticities();
+
+  // Computes the luminance weights (Y of each primary) for these
+  // chromaticities. The weights sum to one.
+  void get_luminance_weights (float yw[3]) const;
+
+  // Computes the matrix that maps linear RGB with these chromaticities to
+  // linear sRGB (Rec. 709 primaries, D65 white), with Bradford adaptation
+  // when the white points differ. Column vectors: rgb' = m * rgb.
+  //
+  // @param[out]  m
+  //  the matrix, only filled in when this function returns true
+  // @return
+  //  false when the chromaticities already are Rec. 709 and no conversion
+  //  is needed
+  bool get_srgb_matrix (float m[3][3]) const;
+};
+
+
+inline Chromaticities::Chromaticities()
+{
+  m_red[0]   = 0.6400f; m_red[1]   = 0.3300f;
+  m_green[0] = 0.3000f; m_green[1] = 0.6000f;
+  m_blue[0]  = 0.1500f; m_blue[1]  = 0.0600f;
+  m_white[0] = 0.3127f; m_white[1] = 0.3290f;
+}
+
+
+//-----------------------------------------------------------------------------
+// Statistics of the samples of a channel. NaN and infinite samples are only
+// counted, the range and the mean are over the finite ones.
+struct ChannelStatistics
+{
+  // samples seen
+  size_t m_sample_count;
+  // NaN and infinite samples among them
+  size_t m_nan_count;
+  size_t m_infinity_count;
+  // range of the finite samples, only meaningful when there are any
+  double m_min;
+  double m_max;
+  // sum of the finite samples
+  double m_sum;
+
+  // inits to no samples
+  ChannelStatistics();
+
+  // Returns the number of finite samples.
+  size_t get_finite_count() const;
+
+  // Returns the mean of the finite samples, 0 when there are none.
+  double get_mean() const;
+};
+
+
+inline ChannelStatistics::ChannelStatistics()
+:
+  m_sample_count(0),
+  m_nan_count(0),
+  m_infinity_count(0),
+  m_min(HUGE_VAL),
+  m_max(-HUGE_VAL),
+  m_sum(0.0)
+{}
+
+
+inline size_t ChannelStatistics::get_finite_count() const
+{
+  return m_sample_count - m_nan_count - m_infinity_count;
+}
+
+
+inline double ChannelStatistics::get_mean() const
+{
+  const size_t count = get_finite_count();
+  return count > 0 ? m_sum / (double)count : 0.0;
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Gets the rows of a file right after they are decoded, while they are
+// still in cache, e.g. to meter them without a pass of its own. See
+// File::set_band_observer().
+class BandObserver
+{
+public:
+
+  virtual ~BandObserver() {}
+
+  // Called on the thread reading the file when rows
+  // [first_row, first_row + row_count) were decoded into a row slot of the
+  // channels. Those rows must not be changed.
+  virtual void band_decoded (const File   &file,
+                             const size_t first_row,
+                             const size_t row_count,
+                             const size_t slot) = 0;
+};
+
+
+
+//-----------------------------------------------------------------------------
+// Number of row slots of a channel. Each slot holds a band of rows of its
+// own, so one band can be decoded while the others are being converted.
+const size_t ROW_SLOT_COUNT = 4;
+
+
+
+//-----------------------------------------------------------------------------
+// Wraps a data channel from the file in memory. A channel holds a band of
+// consecutive rows of the image per row slot, which is the whole image once
+// the file is loaded. Slot 0 is the default one; the accessors below take
+// the slot to look at.
 class Channel
 {
 public:
 
-  // Creates a new channel.
+  // Creates a new channel, it holds no rows until the file reads some.
   Channel (const std::string   &name,
            const PixelDataType type,
            const size_t        pixel_width,
-           const size_t        pixel_height);
+           const int           x_sampling = 1,
+           const int           y_sampling = 1);
           
   // Destroys this channel.
   ~Channel ();
@@ -48,11 +176,23 @@ public:
   PixelDataType get_pixel_data_type() const;
 
   // Fetches the raw data pointer. Pixel (x, y)'s index is calculated with:
-  // index = x * x_stride + y * y_stride
-  const char* get_data() const;
+  // index = x * x_stride + (y - first_row) * y_stride
+  const char* get_data (const size_t slot = 0) const;
+
+  // Fetches the raw data of image row y, which must be one of the rows held
+  // in the slot. For subsampled channels this is the line holding the
+  // samples for row y.
+  const char* get_row (const size_t y,
+                       const size_t slot = 0) const;
+
+  // Returns the first image row held in the slot.
+  size_t get_first_row (const size_t slot = 0) const;
+
+  // Returns the number of image rows held in the slot.
+  size_t get_row_count (const size_t slot = 0) const;
   
-  // Returns the size of the data in bytes.
-  size_t get_byte_size() const;
+  // Returns the size of the data in the slot in bytes.
+  size_t get_byte_size (const size_t slot = 0) const;
 
   // Returns x-stride in bytes, this is also the size of a singe data element.
   size_t get_x_stride() const;
@@ -60,11 +200,24 @@ public:
   // Returns the y-stride in bytes.
   size_t get_y_stride() const;
 
-  // Returns the number of pixels in this channel.
-  size_t get_pixel_count() const;
+  // Returns the number of pixels held in the slot.
+  size_t get_pixel_count (const size_t slot = 0) const;
+
+  // Returns the horizontal subsampling rate, e.g. 2 for chroma channels.
+  // Subsampled pixel (x, y)'s index is still calculated with the strides
+  // above, but on (x / x_sampling, y / y_sampling).
+  int get_x_sampling() const;
+
+  // Returns the vertical subsampling rate.
+  int get_y_sampling() const;
+
+  // Returns the statistics of the samples read so far, they are only
+  // gathered when the file is asked to, see File::set_gather_statistics().
+  const ChannelStatistics& get_statistics() const;
 
 private:
 
+  friend class File;
   friend class Layer;
 
   const std::string   m_name;
@@ -72,11 +225,39 @@ private:
   const PixelDataType m_pixel_data_type;
   const size_t        m_x_stride;
   const size_t        m_y_stride;
-  const size_t        m_line_count;
-  char                *const m_buffer;
+  const int           m_x_sampling;
+  const int           m_y_sampling;
+  // a band of rows
+  struct RowSlot
+  {
+    // first image row & number of image rows in the buffer
+    size_t        m_first_row;
+    size_t        m_row_count;
+    // lines of the band, starting on a cache line
+    AlignedBuffer m_buffer;
+  };
+  RowSlot             m_slots[ROW_SLOT_COUNT];
+  // statistics of lines [0, m_statistics_lines) of the image
+  ChannelStatistics   m_statistics;
+  size_t              m_statistics_lines;
 
   // internal function to set a layer
   void set_layer(const Layer *layer);
+
+  // Makes room for image rows [first_row, first_row + row_count) in a
+  // slot, growing its buffer when needed. For subsampled channels first_row
+  // must be a multiple of the sampling rate.
+  void set_rows (const size_t first_row,
+                 const size_t row_count,
+                 const size_t slot);
+
+  // Returns the number of lines needed to hold row_count image rows.
+  size_t get_line_count (const size_t row_count) const;
+
+  // Adds the lines in the buffer of a slot to the statistics. Lines that
+  // were counted before, e.g. a row read again by the next band, are
+  // skipped.
+  void gather_statistics (const size_t slot);
 };
 
 
@@ -104,15 +285,47 @@ inline PixelDataType Channel::get_pixel_data_type() const
 }
 
 
-inline const char* Channel::get_data() const
+inline const char* Channel::get_data (const size_t slot) const
+{
+  return m_slots[slot].m_buffer.get();
+}
+
+
+inline const char* Channel::get_row (const size_t y,
+                                     const size_t slot) const
+{
+  const RowSlot &rows = m_slots[slot];
+  return rows.m_buffer.get() + (y - rows.m_first_row) / m_y_sampling * m_y_stride;
+}
+
+
+inline const ChannelStatistics& Channel::get_statistics() const
+{
+  return m_statistics;
+}
+
+
+inline size_t Channel::get_first_row (const size_t slot) const
 {
-  return m_buffer;
+  return m_slots[slot].m_first_row;
+}
+
+
+inline size_t Channel::get_row_count (const size_t slot) const
+{
+  return m_slots[slot].m_row_count;
+}
+
+
+inline size_t Channel::get_line_count (const size_t row_count) const
+{
+  return (row_count + m_y_sampling - 1) / m_y_sampling;
 }
   
 
-inline size_t Channel::get_byte_size() const
+inline size_t Channel::get_byte_size (const size_t slot) const
 {
-  return m_y_stride * m_line_count;
+  return m_y_stride * get_line_count (m_slots[slot].m_row_count);
 }
 
 
@@ -128,9 +341,21 @@ inline size_t Channel::get_y_stride() const
 }
 
 
-inline size_t Channel::get_pixel_count() const
+inline size_t Channel::get_pixel_count (const size_t slot) const
 {
-  return (m_y_stride / m_x_stride) * m_line_count;
+  return (m_y_stride / m_x_stride) * get_line_count (m_slots[slot].m_row_count);
+}
+
+
+inline int Channel::get_x_sampling() const
+{
+  return m_x_sampling;
+}
+
+
+inline int Channel::get_y_sampling() const
+{
+  return m_y_sampling;
 }
 
 
@@ -161,7 +386,7 @@ public:
 
   // Checks if we have a channel with the given name.
   bool find_channel (const std::string &name,
-                     const Channel     *channel) const;
+                     const Channel     **channel) const;
 
 private:
 
@@ -233,17 +458,17 @@ inline const Channel* Layer::get_channel_at (const size_t index) const
 
 
 inline bool Layer::find_channel (const std::string &name,
-                                 const Channel     *channel) const
+                                 const Channel     **channel) const
 {
   IndexT::const_iterator found = m_index.find(name);
   if (found == m_index.end())
     {
-      channel = NULL;
+      *channel = NULL;
       return false;
     }
   else
     {
-      channel = m_channels[found->second];
+      *channel = m_channels[found->second];
       return true;
     }
 }
@@ -260,7 +485,9 @@ inline void Layer::insert_channel (Channel *channel)
 
 //-----------------------------------------------------------------------------
 // Wraps the data in an OpenEXR file. Once the file is loaded, all the data
-// is loaded into memory.
+// is loaded into memory. Alternatively the file is opened and read a band of
+// rows at a time, the channels then only hold the last band read into each
+// of their row slots.
 class File 
 {
 public:
@@ -271,13 +498,67 @@ public:
   // Destroys this file.
   ~File();
 
-  // Loads the exr file into memory. Returns true on success, false on failure.
-  // On failure the error message should contain something meaningfull.
+  // Loads the exr file into memory, opening it first unless it's open.
+  // Returns true on success, false on failure. On failure the error message
+  // should contain something meaningfull.
   bool load(std::string &error_msg);
 
+  // Starts loading the file into memory on a thread of its own and returns
+  // right away, see LoadFuture. The file must not be touched until the load
+  // is done. The caller deletes the future, which cancels an unfinished load.
+  LoadFuture* load_async();
+
+  // Opens the exr file and reads the header, this sets up the layers and
+  // channels but doesn't read any pixels. Returns true on success.
+  bool open(std::string &error_msg);
+
+  // Decodes rows [first_row, first_row + row_count) into the channels,
+  // replacing the rows they held before. The file must be open. When the
+  // file has subsampled channels, first_row must be even. Large reads are
+  // decoded a few blocks at a time and report to the progress, if any;
+  // they fail between two of them once it's cancelled.
+  bool read_rows(const size_t first_row,
+                 const size_t row_count,
+                 std::string  &error_msg);
+
+  // Same as above, but decodes into a row slot of the channels. Only that
+  // slot is touched, so other threads may use the rows in the other slots
+  // meanwhile; the file itself must be read by one thread at a time.
+  bool read_rows(const size_t first_row,
+                 const size_t row_count,
+                 const size_t slot,
+                 std::string  &error_msg);
+
+  // Reads all rows a band at a time to gather the statistics of the
+  // channels, without keeping the pixels around. The file must be open.
+  bool read_statistics(std::string &error_msg);
+
+  // Turns gathering channel statistics on or off for the rows read from
+  // now on. The statistics are updated right after each band is decoded,
+  // while it is still in cache. Off by default.
+  void set_gather_statistics(const bool gather);
+
+  // Sets the observer that gets the rows decoded from now on, a few blocks
+  // at a time, NULL for none. The observer isn't owned.
+  void set_band_observer(BandObserver *observer);
+
+  // Sets the progress the rows decoded from now on are counted in, and
+  // that cancels the reads, NULL for none. The progress isn't owned.
+  void set_progress(LoadProgress *progress);
+
+  // Returns the progress set, NULL if none.
+  LoadProgress* get_progress() const;
+
   // Checks if the file was successfully loaded in memory.
   bool is_loaded() const;
 
+  // Checks if the file was successfully opened.
+  bool is_open() const;
+
+  // Returns the number of scanlines compressed together in the file. Reading
+  // whole blocks avoids decompressing a block twice.
+  size_t get_lines_per_block() const;
+
   // Returns the load path of this file.
   const std::string& get_path() const;
 
@@ -287,6 +568,10 @@ public:
   // Returns the height of the file in pixels.
   size_t get_height() const;
 
+  // Returns the chromaticities from the header, or the defaults when the
+  // file doesn't specify them.
+  const Chromaticities& get_chromaticities() const;
+
   // Returns the number of layers.
   size_t get_layer_count() const;
 
@@ -304,12 +589,25 @@ private:
 
   // flag indicating successfull disk load
   bool              m_loaded;
+  // gather channel statistics while reading
+  bool              m_gather_statistics;
+  // progress of the reads, not owned
+  LoadProgress      *m_progress;
+  // gets the rows as they are decoded, not owned
+  BandObserver      *m_observer;
+  // scanlines per compressed block
+  size_t            m_lines_per_block;
   // path to the file on disk
   const std::string m_path;
   // width in pixels
   size_t            m_width;
   // height in pixels
   size_t            m_height;
+  // origin of the data window
+  int               m_x_offset;
+  int               m_y_offset;
+  // primaries & white point
+  Chromaticities    m_chromaticities;
   // OpenEXR lib file handle
   void              *m_handle;
   // layer name index
@@ -320,6 +618,10 @@ private:
   // inserts a layer
   void insert_layer (Layer *layer);
 
+  // returns the rows decoded at once: whole compressed blocks, an even
+  // number of rows for subsampled channels
+  size_t get_chunk_rows () const;
+
   // splits a full channel name (e.g. AO.G into AO & G)
   static void split_full_channel_name (const std::string &input,
                                        std::string       &layer_name,
@@ -327,12 +629,56 @@ private:
 };
 
 
+inline bool File::read_rows(const size_t first_row,
+                            const size_t row_count,
+                            std::string  &error_msg)
+{
+  return read_rows (first_row, row_count, 0, error_msg);
+}
+
+
+inline void File::set_gather_statistics(const bool gather)
+{
+  m_gather_statistics = gather;
+}
+
+
+inline void File::set_band_observer(BandObserver *observer)
+{
+  m_observer = observer;
+}
+
+
+inline void File::set_progress(LoadProgress *progress)
+{
+  m_progress = progress;
+}
+
+
+inline LoadProgress* File::get_progress() const
+{
+  return m_progress;
+}
+
+
 inline bool File::is_loaded() const
 {
   return m_loaded;
 }
 
 
+inline bool File::is_open() const
+{
+  return m_handle != NULL;
+}
+
+
+inline size_t File::get_lines_per_block() const
+{
+  return m_lines_per_block;
+}
+
+
 inline const std::string& File::get_path() const
 {
   return m_path;
@@ -351,6 +697,12 @@ inline size_t File::get_height() const
 }
 
 
+inline const Chromaticities& File::get_chromaticities() const
+{
+  return m_chromaticities;
+}
+
+
 inline size_t File::get_layer_count() const
 {
   return m_layers.size();
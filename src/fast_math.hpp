@@ -0,0 +1,102 @@
+#ifndef _FAST_MATH_HPP_
+#define _FAST_MATH_HPP_ 1
+
+// system includes
+#include <stdint.h>
+#include <string.h>
+
+
+//-----------------------------------------------------------------------------
+// Branch-free float helpers for the conversion loops. Everything is written
+// with integer bit operations, multiplies, adds and selects so loops calling
+// these functions vectorize.
+
+
+// Reinterprets the bits of a float as an integer and back. memcpy keeps this
+// free of aliasing issues and compiles to a plain register move.
+inline uint32_t float_bits (const float x)
+{
+  uint32_t bits;
+  memcpy (&bits, &x, sizeof(bits));
+  return bits;
+}
+
+
+inline float bits_float (const uint32_t bits)
+{
+  float x;
+  memcpy (&x, &bits, sizeof(x));
+  return x;
+}
+
+
+// Value based min/max, std::min/max return references which can keep the
+// compiler from if-converting the loops below.
+inline float min_value (const float a, const float b)
+{
+  return a < b ? a : b;
+}
+
+
+inline float max_value (const float a, const float b)
+{
+  return a > b ? a : b;
+}
+
+
+// Approximates log2(x) for x >= 0. The exponent is taken from the bit
+// pattern, log2 of the mantissa m in [1, 2) is a degree 5 polynomial in
+// m - 1 with an absolute error of 1.7e-5. Zero and denormals map to -127.
+inline float fast_log2 (const float x)
+{
+  const uint32_t bits = float_bits (x);
+  const float    e    = (float)((int32_t)(bits >> 23) - 127);
+  const float    t    = bits_float ((bits & 0x007fffffu) | 0x3f800000u) - 1.f;
+  const float    p    = 0.0452682936f;
+  return e + t * (1.4418799f +
+             t * (-0.708865218f +
+             t * (0.415245563f +
+             t * (-0.193516527f +
+             t * p))));
+}
+
+
+// Approximates exp2(x) for x in [-126, 127]. The integer part, rounded up,
+// goes straight into the exponent bits, 2^f for the fraction f in (-1, 0]
+// is a degree 5 polynomial. The polynomial is within 9e-8 of 2^f, rounding
+// while evaluating it in float brings the relative error to 3e-7 (measured
+// over every float in [-20, 20]; the exponent bits add nothing to it).
+inline float fast_exp2 (const float x)
+{
+  const int32_t t     = (int32_t)x;
+  const int32_t i     = t + (x > (float)t);
+  const float   f     = x - (float)i;
+  const float   scale = bits_float ((uint32_t)(i + 127) << 23);
+  const float   p     = 1.f + f * (0.693143568f +
+                              f * (0.240178903f +
+                              f * (0.0552940413f +
+                              f * (0.00920217621f +
+                              f * 0.000943510812f))));
+  return scale * p;
+}
+
+
+// Approximates x^p for x in [0, 1] and p > 0.
+inline float fast_pow (const float x,
+                       const float p)
+{
+  return fast_exp2 (max_value (p * fast_log2 (x), -126.f));
+}
+
+
+inline float clamp01 (const float x)
+{
+  return min_value (max_value (x, 0.f), 1.f);
+}
+
+
+
+#endif // #ifndef _FAST_MATH_HPP_
+
+
+/* vim: set ts=2 sw=2 : */
@@ -0,0 +1,1025 @@
+// system includes
+#include <algorithm>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+// OpenEXR includes
+#include <half.h>
+// plugin includes
+#include "local_tone.hpp"
+// myself
+#include "kernels.hpp"
+
+
+//-----------------------------------------------------------------------------
+// Helpers
+
+
+// Reads samples of a given pixel data type as floats.
+template<exr::PixelDataType T>
+struct Sample;
+
+
+template<>
+struct Sample<exr::PIXEL_DATA_TYPE_FLOAT>
+{
+  typedef float Type;
+  static inline float to_float (const Type x) { return x; }
+};
+
+
+template<>
+struct Sample<exr::PIXEL_DATA_TYPE_HALF>
+{
+  typedef half Type;
+  static inline float to_float (const Type x) { return x; }
+};
+
+
+template<>
+struct Sample<exr::PIXEL_DATA_TYPE_UINT>
+{
+  typedef unsigned int Type;
+  static inline float to_float (const Type x) { return (float)x; }
+};
+
+
+// Number of pixels the kernels process at once, the float scratch rows for
+// four channels stay in L1. A multiple of the dither tile size.
+static const size_t KERNEL_CHUNK = 1024;
+
+
+// Loads n samples of a channel as floats, starting at sample index first,
+// and maps them with scale * x + bias.
+template<exr::PixelDataType T>
+static void load_samples (const char   *data,
+                          const size_t first,
+                          const size_t n,
+                          const float  scale,
+                          const float  bias,
+                          float        *out)
+{
+  typedef typename Sample<T>::Type Type;
+
+  const Type *in = (const Type*)data + first;
+  for (size_t i = 0; i < n; ++i)
+    {
+      out[i] = Sample<T>::to_float (in[i]) * scale + bias;
+    }
+}
+
+
+// Loader instances, indexed by [data type - 1].
+static const SampleLoader SAMPLE_LOADERS[3] =
+{
+  load_samples<exr::PIXEL_DATA_TYPE_FLOAT>,
+  load_samples<exr::PIXEL_DATA_TYPE_HALF>,
+  load_samples<exr::PIXEL_DATA_TYPE_UINT>,
+};
+
+
+// Finds the smallest and largest value in an integer channel. Plain min/max
+// reductions, which the compiler vectorizes.
+static void uint_range (const unsigned int *data,
+                        const size_t       n,
+                        unsigned int       &lo,
+                        unsigned int       &hi)
+{
+  unsigned int min_value = ~0u;
+  unsigned int max_value = 0u;
+  for (size_t i = 0; i < n; ++i)
+    {
+      min_value = std::min (min_value, data[i]);
+      max_value = std::max (max_value, data[i]);
+    }
+  lo = min_value;
+  hi = max_value;
+}
+
+
+// Quantizes a float in [0, 1] to the nearest 8-bit value after adding a
+// dither offset (in 8-bit steps). Written with selects rather than branches
+// so the compiler can turn it into packed instructions.
+static inline guchar quantize (const float x,
+                               const float offset)
+{
+  const float v       = x * 255.f + offset;
+  const float clamped = v < 0.f ? 0.f : (v > 255.f ? 255.f : v);
+  return (guchar)(clamped + 0.5f);
+}
+
+
+// Number of color channels in an N channel layout, 2 (YA) and 4 (RGBA)
+// channels end with alpha.
+template<size_t N>
+struct ColorCount
+{
+  static const size_t VALUE = (N == 2 || N == 4) ? N - 1 : N;
+};
+
+
+// Alpha below which a pixel is treated as fully transparent when
+// unpremultiplying. Its color is kept as-is rather than blown up by a
+// near-zero divide; such pixels quantize to alpha 0 anyway.
+static const float ALPHA_EPSILON = 1e-6f;
+
+
+// Converts RGB planes with a 3x3 matrix and scales them by exposure, and
+// when UNPREMULTIPLY by 1 / alpha. The matrix goes into locals so the
+// compiler knows the stores to the planes don't change it.
+template<bool UNPREMULTIPLY>
+static void mix_primaries (const float  m[3][3],
+                           const float  exposure,
+                           const float  *alpha,
+                           float *const *planes,
+                           const size_t n)
+{
+  const float m00 = m[0][0], m01 = m[0][1], m02 = m[0][2];
+  const float m10 = m[1][0], m11 = m[1][1], m12 = m[1][2];
+  const float m20 = m[2][0], m21 = m[2][1], m22 = m[2][2];
+  float       *r  = planes[0];
+  float       *g  = planes[1];
+  float       *b  = planes[2];
+  for (size_t i = 0; i < n; ++i)
+    {
+      float scale = exposure;
+      if (UNPREMULTIPLY)
+        {
+          scale /= alpha[i] > ALPHA_EPSILON ? alpha[i] : 1.f;
+        }
+      const float x = r[i];
+      const float y = g[i];
+      const float z = b[i];
+      r[i]          = (m00 * x + m01 * y + m02 * z) * scale;
+      g[i]          = (m10 * x + m11 * y + m12 * z) * scale;
+      b[i]          = (m20 * x + m21 * y + m22 * z) * scale;
+    }
+}
+
+
+// Counts the pixels flagged by DisplayTransform::sanitize(), copies the
+// flags into the mask (when there is one) and clears them for the next run.
+static size_t take_flags (guchar       *flags,
+                          const size_t n,
+                          guchar       *mask)
+{
+  size_t count = 0;
+  for (size_t i = 0; i < n; ++i)
+    {
+      count += flags[i];
+    }
+  if (mask)
+    {
+      for (size_t i = 0; i < n; ++i)
+        {
+          mask[i] |= flags[i];
+        }
+    }
+  memset (flags, 0, n);
+  return count;
+}
+
+
+// Interleaves N float rows into 8-bit pixels. The row must start at a
+// multiple of DITHER_TILE_SIZE, dither is a row of the dither pattern or
+// NULL. All channels of a pixel get the same offset, which keeps grays gray.
+template<size_t N>
+static void pack_row (const float *const *planes,
+                      const size_t       n,
+                      const float        *dither,
+                      guchar             *out)
+{
+  if (!dither)
+    {
+      for (size_t i = 0; i < n; ++i)
+        {
+          for (size_t j = 0; j < N; ++j)
+            {
+              out[N * i + j] = quantize (planes[j][i], 0.f);
+            }
+        }
+      return;
+    }
+
+  // one tile width at a time, the offsets are then a plain array lookup
+  for (size_t x = 0; x < n; x += DITHER_TILE_SIZE)
+    {
+      const size_t m = std::min (DITHER_TILE_SIZE, n - x);
+      for (size_t i = 0; i < m; ++i)
+        {
+          for (size_t j = 0; j < N; ++j)
+            {
+              out[N * (x + i) + j] = quantize (planes[j][x + i], dither[i]);
+            }
+        }
+    }
+}
+
+
+// Stores n values into every stride-th sample of out, starting at out.
+template<typename T>
+static void interleave (const T      *values,
+                        const size_t n,
+                        const size_t stride,
+                        T            *out)
+{
+  for (size_t i = 0; i < n; ++i)
+    {
+      out[i * stride] = values[i];
+    }
+}
+
+
+// Stores n float values as half into every stride-th sample of out.
+static void interleave_half (const float  *values,
+                             const size_t n,
+                             const size_t stride,
+                             half         *out)
+{
+  for (size_t i = 0; i < n; ++i)
+    {
+      out[i * stride] = half (values[i]);
+    }
+}
+
+
+// Stores n linear pixels of channel_count planes as interleaved half or
+// float samples.
+static void store_linear_row (const float *const   *planes,
+                              const size_t         channel_count,
+                              const size_t         n,
+                              const ImagePrecision precision,
+                              guchar               *out)
+{
+  for (size_t j = 0; j < channel_count; ++j)
+    {
+      if (precision == IMAGE_PRECISION_HALF)
+        {
+          interleave_half (planes[j], n, channel_count, (half*)out + j);
+        }
+      else
+        {
+          interleave (planes[j], n, channel_count, (float*)out + j);
+        }
+    }
+}
+
+
+// Kernel parameter for layers whose channels don't share a data type, the
+// data types start at 1.
+static const int MIXED_TYPES = 0;
+
+
+// Loads n samples of image row y of a channel as floats, starting at sample
+// x. TYPE is the data type of the channel, so the load is inlined into the
+// kernel; float and half channels are never mapped, so theirs is a plain
+// conversion.
+template<int TYPE>
+struct ChunkLoader
+{
+  static inline void load (const ChannelInput &input,
+                           const size_t       y,
+                           const size_t       x,
+                           const size_t       n,
+                           float              *out)
+  {
+    typedef Sample<(exr::PixelDataType)TYPE> SampleType;
+    typedef typename SampleType::Type        Type;
+
+    const Type *in = (const Type*)input.get_row (y) + x;
+    if (TYPE == exr::PIXEL_DATA_TYPE_UINT)
+      {
+        const float scale = input.m_scale;
+        const float bias  = input.m_bias;
+        for (size_t i = 0; i < n; ++i)
+          {
+            out[i] = SampleType::to_float (in[i]) * scale + bias;
+          }
+      }
+    else
+      {
+        for (size_t i = 0; i < n; ++i)
+          {
+            out[i] = SampleType::to_float (in[i]);
+          }
+      }
+  }
+};
+
+
+// Layers of mixed data types load each channel through its own loader.
+template<>
+struct ChunkLoader<MIXED_TYPES>
+{
+  static inline void load (const ChannelInput &input,
+                           const size_t       y,
+                           const size_t       x,
+                           const size_t       n,
+                           float              *out)
+  {
+    input.load (y, x, n, out);
+  }
+};
+
+
+// Conversion kernel for a fixed channel count and data type, see
+// ChunkLoader. The channels are loaded to float a chunk at a time; the
+// channel count is known at compile time so packing is a straight-line loop
+// the compiler can vectorize.
+template<size_t N, int TYPE>
+static size_t convert_kernel (const DisplayTransform &transform,
+                              const LocalToneMap     *local,
+                              const ChannelInput     *input,
+                              const size_t           width,
+                              const size_t           y_begin,
+                              const size_t           y_end,
+                              guchar                 *output,
+                              guchar                 *mask)
+{
+  float buffer[N][KERNEL_CHUNK];
+  float *planes[N];
+  for (size_t j = 0; j < N; ++j)
+    {
+      planes[j] = buffer[j];
+    }
+  guchar flags[KERNEL_CHUNK];
+  memset (flags, 0, sizeof(flags));
+
+  size_t count = 0;
+  for (size_t y = y_begin; y < y_end; ++y)
+    {
+      guchar *out = output + (y - y_begin) * width * N;
+      for (size_t x = 0; x < width; x += KERNEL_CHUNK)
+        {
+          const size_t n = std::min (KERNEL_CHUNK, width - x);
+          bool         found = false;
+          for (size_t j = 0; j < N; ++j)
+            {
+              ChunkLoader<TYPE>::load (input[j], y, x, n, buffer[j]);
+              if (input[j].m_non_finite)
+                {
+                  found |= transform.sanitize (buffer[j], n, flags);
+                }
+            }
+          if (found)
+            {
+              count += take_flags (flags,
+                                   n,
+                                   mask ? mask + (y - y_begin) * width + x : NULL);
+            }
+          if (local)
+            {
+              local->apply (planes, ColorCount<N>::VALUE, x, y, n);
+            }
+          transform.apply (planes,
+                           ColorCount<N>::VALUE,
+                           ColorCount<N>::VALUE < N ? buffer[N - 1] : NULL,
+                           n);
+          pack_row<N> (planes, n, transform.get_dither_row (y), out + N * x);
+        }
+    }
+  return count;
+}
+
+
+typedef size_t (*ConvertKernel)(const DisplayTransform &transform,
+                                const LocalToneMap     *local,
+                                const ChannelInput     *input,
+                                const size_t           width,
+                                const size_t           y_begin,
+                                const size_t           y_end,
+                                guchar                 *output,
+                                guchar                 *mask);
+
+
+// Kernel instances, indexed by [data type shared by all channels, or
+// MIXED_TYPES][channel count - 1].
+static const ConvertKernel CONVERT_KERNELS[4][4] =
+{
+  {
+    convert_kernel<1, MIXED_TYPES>,
+    convert_kernel<2, MIXED_TYPES>,
+    convert_kernel<3, MIXED_TYPES>,
+    convert_kernel<4, MIXED_TYPES>,
+  },
+  {
+    convert_kernel<1, exr::PIXEL_DATA_TYPE_FLOAT>,
+    convert_kernel<2, exr::PIXEL_DATA_TYPE_FLOAT>,
+    convert_kernel<3, exr::PIXEL_DATA_TYPE_FLOAT>,
+    convert_kernel<4, exr::PIXEL_DATA_TYPE_FLOAT>,
+  },
+  {
+    convert_kernel<1, exr::PIXEL_DATA_TYPE_HALF>,
+    convert_kernel<2, exr::PIXEL_DATA_TYPE_HALF>,
+    convert_kernel<3, exr::PIXEL_DATA_TYPE_HALF>,
+    convert_kernel<4, exr::PIXEL_DATA_TYPE_HALF>,
+  },
+  {
+    convert_kernel<1, exr::PIXEL_DATA_TYPE_UINT>,
+    convert_kernel<2, exr::PIXEL_DATA_TYPE_UINT>,
+    convert_kernel<3, exr::PIXEL_DATA_TYPE_UINT>,
+    convert_kernel<4, exr::PIXEL_DATA_TYPE_UINT>,
+  },
+};
+
+
+// Maps object/material ids to colours. The fmix32 finalizer of MurmurHash3
+// spreads neighbouring ids far apart in the colour cube and maps id 0, which
+// usually marks the background, to black. Only shifts, xors and 32-bit
+// multiplies, so the loop vectorizes.
+//
+// @param[in]   ids
+//    id channel data
+// @param[in]   pixel_count
+//    number of pixels to convert
+// @param[out]  output
+//    interleaved 8-bit RGB output, pixel_count * 3 bytes
+static void id_to_rgb (const unsigned int *ids,
+                       const size_t       pixel_count,
+                       guchar             *output)
+{
+  for (size_t i = 0; i < pixel_count; ++i)
+    {
+      unsigned int h = ids[i];
+      h ^= h >> 16;
+      h *= 0x85ebca6bu;
+      h ^= h >> 13;
+      h *= 0xc2b2ae35u;
+      h ^= h >> 16;
+      output[3 * i + 0] = (guchar)(h);
+      output[3 * i + 1] = (guchar)(h >> 8);
+      output[3 * i + 2] = (guchar)(h >> 16);
+    }
+}
+
+
+// Upsamples a row of horizontally subsampled chroma to full width. The
+// chroma samples sit on the even pixels, bilinear filtering interpolates
+// the odd pixels in between.
+static void upsample_row (const ChromaFilter filter,
+                          const float        *in,
+                          const size_t       width,
+                          float              *out)
+{
+  const size_t in_width = (width + 1) / 2;
+  if (filter == CHROMA_FILTER_NEAREST)
+    {
+      for (size_t i = 0; i < width / 2; ++i)
+        {
+          out[2 * i]     = in[i];
+          out[2 * i + 1] = in[i];
+        }
+    }
+  else
+    {
+      for (size_t i = 0; i + 1 < in_width; ++i)
+        {
+          out[2 * i]     = in[i];
+          out[2 * i + 1] = 0.5f * (in[i] + in[i + 1]);
+        }
+      if (width % 2 == 0)
+        {
+          out[width - 2] = in[in_width - 1];
+        }
+    }
+  out[width - 1] = in[in_width - 1];
+}
+
+
+// Averages two rows, used to interpolate chroma vertically.
+static void blend_rows (const float  *a,
+                        const float  *b,
+                        const size_t n,
+                        float        *out)
+{
+  for (size_t i = 0; i < n; ++i)
+    {
+      out[i] = 0.5f * (a[i] + b[i]);
+    }
+}
+
+
+// Reconstructs RGB from luminance and full resolution chroma, this is the
+// inverse of the transform in Imf::RgbaYca:
+//   RY = (R - Y) / Y, BY = (B - Y) / Y, Y = yw . RGB
+static void yca_to_rgb_row (const float  yw[3],
+                            const float  *lum,
+                            const float  *ry,
+                            const float  *by,
+                            const size_t n,
+                            float        *r,
+                            float        *g,
+                            float        *b)
+{
+  const float inv_yw_g = 1.f / yw[1];
+  for (size_t i = 0; i < n; ++i)
+    {
+      r[i] = (ry[i] + 1.f) * lum[i];
+      b[i] = (by[i] + 1.f) * lum[i];
+      g[i] = (lum[i] - r[i] * yw[0] - b[i] * yw[2]) * inv_yw_g;
+    }
+}
+
+
+// Loads chroma row k and upsamples it horizontally to full width.
+//
+// @param[in]   filter
+//    chroma upsampling filter
+// @param[in]   input
+//    chroma channel
+// @param[in]   k
+//    chroma row to load
+// @param[in]   width
+//    width of the image in pixels
+// @param[in]   scratch
+//    buffer for the subsampled row, at least (width + 1) / 2 floats
+// @param[out]  out
+//    full width chroma row
+static void load_chroma_row (const ChromaFilter filter,
+                             const ChannelInput &input,
+                             const size_t       k,
+                             const size_t       width,
+                             float              *scratch,
+                             float              *out)
+{
+  input.load (2 * k, 0, (width + 1) / 2, scratch);
+  upsample_row (filter, scratch, width, out);
+}
+
+
+// Converts row y from its luminance and the given full width chroma.
+//
+// @param[in]   transform
+//    display transform for the color channels
+// @param[in]   local
+//    local tone mapping, may be NULL
+// @param[in]   precision
+//    sample format of out, high precision rows are stored linear as they are
+// @param[in]   yw
+//    luminance weights
+// @param[in]   input
+//    Y, RY, BY and optionally A channels
+// @param[in]   y
+//    row to convert
+// @param[in]   width
+//    width of the image in pixels
+// @param[in]   ry, by
+//    full width chroma for this row
+// @param[in]   lum, rgba
+//    row buffers of width floats
+// @param[in]   flags
+//    row of width cleared bytes, see take_flags()
+// @param[out]  out
+//    interleaved 8-bit RGB(A) row
+// @param[out]  mask
+//    non-finite mask for this row, may be NULL
+// @return
+//    number of pixels with non-finite samples
+static size_t yca_row (const DisplayTransform          &transform,
+                       const LocalToneMap              *local,
+                       const ImagePrecision            precision,
+                       const float                     yw[3],
+                       const std::vector<ChannelInput> &input,
+                       const size_t                    y,
+                       const size_t                    width,
+                       const float                     *ry,
+                       const float                     *by,
+                       float                           *lum,
+                       float *const                    *rgba,
+                       guchar                          *flags,
+                       guchar                          *out,
+                       guchar                          *mask)
+{
+  const bool has_alpha = input.size() == 4;
+
+  input[0].load (y, 0, width, lum);
+  yca_to_rgb_row (yw, lum, ry, by, width, rgba[0], rgba[1], rgba[2]);
+  if (has_alpha)
+    {
+      input[3].load (y, 0, width, rgba[3]);
+    }
+  if (precision != IMAGE_PRECISION_U8)
+    {
+      store_linear_row (rgba, input.size(), width, precision, out);
+      return 0;
+    }
+
+  // non-finite luminance or chroma ends up in the reconstructed RGB
+  bool found = false;
+  if (input[0].m_non_finite || input[1].m_non_finite || input[2].m_non_finite)
+    {
+      for (size_t j = 0; j < 3; ++j)
+        {
+          found |= transform.sanitize (rgba[j], width, flags);
+        }
+    }
+  if (has_alpha && input[3].m_non_finite)
+    {
+      found |= transform.sanitize (rgba[3], width, flags);
+    }
+  const size_t count = found ? take_flags (flags, width, mask) : 0;
+  if (local)
+    {
+      local->apply (rgba, 3, 0, y, width);
+    }
+
+  if (has_alpha)
+    {
+      transform.apply (rgba, 3, rgba[3], width);
+      pack_row<4> (rgba, width, transform.get_dither_row (y), out);
+    }
+  else
+    {
+      transform.apply (rgba, 3, NULL, width);
+      pack_row<3> (rgba, width, transform.get_dither_row (y), out);
+    }
+  return count;
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Implementation of ChannelInput
+
+
+ChannelInput::ChannelInput (const exr::Channel *channel,
+                            const bool         normalize)
+:
+  m_channel (channel),
+  m_load (SAMPLE_LOADERS[channel->get_pixel_data_type() - 1]),
+  m_scale (1.f),
+  m_bias (0.f),
+  m_non_finite (channel->get_pixel_data_type() != exr::PIXEL_DATA_TYPE_UINT),
+  m_slot (0)
+{
+  if (channel->get_pixel_data_type() == exr::PIXEL_DATA_TYPE_UINT && normalize)
+    {
+      // the converter gathers statistics over the whole image only, that
+      // spares streamed images keeping all of it around
+      const exr::ChannelStatistics &statistics = channel->get_statistics();
+      unsigned int lo, hi;
+      if (statistics.m_sample_count > 0)
+        {
+          lo = (unsigned int)statistics.m_min;
+          hi = (unsigned int)statistics.m_max;
+        }
+      else
+        {
+          uint_range ((const unsigned int*)channel->get_data(),
+                      channel->get_pixel_count(),
+                      lo,
+                      hi);
+        }
+      if (hi > lo)
+        {
+          m_scale = 1.f / (float)(hi - lo);
+          m_bias  = -(float)lo * m_scale;
+        }
+      else
+        {
+          // constant channel, show it as black or white
+          m_scale = 0.f;
+          m_bias  = hi > 0 ? 1.f : 0.f;
+        }
+    }
+}
+
+
+void make_channel_inputs (const std::vector<const exr::Channel*> &channels,
+                          std::vector<ChannelInput>              &input,
+                          const bool                             normalize)
+{
+  input.clear();
+  input.reserve (channels.size());
+  for (size_t i = 0; i < channels.size(); ++i)
+    {
+      size_t j = 0;
+      while (j < i && channels[j] != channels[i])
+        {
+          ++j;
+        }
+      input.push_back (j < i ? input[j] : ChannelInput (channels[i], normalize));
+    }
+}
+
+
+void set_input_slot (std::vector<ChannelInput> &input,
+                     const size_t              slot)
+{
+  for (size_t i = 0; i < input.size(); ++i)
+    {
+      input[i].m_slot = slot;
+    }
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Implementation of DisplayTransform
+
+
+DisplayTransform::DisplayTransform (const ConversionSettings  &settings,
+                                    const exr::Chromaticities &chromaticities,
+                                    const Lut3D               *lut)
+:
+  m_exposure (powf (2.f, settings.m_exposure)),
+  m_unpremultiply (settings.m_unpremultiply),
+  m_non_finite_policy (settings.m_non_finite_policy),
+  m_convert_primaries (false),
+  m_tone (settings.m_tone_operator,
+          powf (2.f, settings.m_exposure),
+          settings.m_reinhard_white,
+          settings.m_knee_low,
+          settings.m_knee_high,
+          settings.m_defog),
+  m_curve (settings.m_transfer_function, settings.m_gamma),
+  m_lut (lut),
+  m_dither (settings.m_dither_method)
+{
+  // files in sRGB primaries skip the matrix altogether
+  if (settings.m_convert_primaries)
+    {
+      m_convert_primaries = chromaticities.get_srgb_matrix (m_primaries);
+    }
+}
+
+
+// A value is finite exactly when x - x is 0, NaN and infinities give NaN.
+// That test and the replacement are selects, so the loop vectorizes and
+// costs about as much as a copy of the chunk, which stays in L1.
+bool DisplayTransform::sanitize (float        *values,
+                                 const size_t n,
+                                 guchar       *flags) const
+{
+  const bool clamp = m_non_finite_policy == NON_FINITE_POLICY_CLAMP;
+  int        found = 0;
+  for (size_t i = 0; i < n; ++i)
+    {
+      const float x       = values[i];
+      const int   bad     = !(x - x == 0.f);
+      const float inf     = clamp ? (x > 0.f ? FLT_MAX : -FLT_MAX) : 0.f;
+      const float replace = x != x ? 0.f : inf;
+      values[i]           = bad ? replace : x;
+      flags[i]           |= (guchar)bad;
+      found              |= bad;
+    }
+  return found != 0;
+}
+
+
+// Unpremultiplying is folded into the exposure multiply, so it costs a
+// divide per sample but no extra pass over the data. The divide is a
+// select away from the near-zero case, which keeps the loop vectorizable.
+// For RGB the primaries conversion goes in the same loop.
+void DisplayTransform::apply (float *const  *planes,
+                              const size_t  color_count,
+                              const float   *alpha,
+                              const size_t  n) const
+{
+  const float *unpremultiply = m_unpremultiply ? alpha : NULL;
+  if (color_count == 3 && m_convert_primaries)
+    {
+      if (unpremultiply)
+        {
+          mix_primaries<true> (m_primaries, m_exposure, unpremultiply, planes, n);
+        }
+      else
+        {
+          mix_primaries<false> (m_primaries, m_exposure, NULL, planes, n);
+        }
+    }
+  else
+    {
+      const float exposure = m_exposure;
+      for (size_t j = 0; j < color_count; ++j)
+        {
+          float *plane = planes[j];
+          if (unpremultiply)
+            {
+              for (size_t i = 0; i < n; ++i)
+                {
+                  const float a = alpha[i] > ALPHA_EPSILON ? alpha[i] : 1.f;
+                  plane[i] *= exposure / a;
+                }
+            }
+          else
+            {
+              for (size_t i = 0; i < n; ++i)
+                {
+                  plane[i] *= exposure;
+                }
+            }
+        }
+    }
+
+  if (m_tone.get_operator() != TONE_OPERATOR_NONE)
+    {
+      for (size_t j = 0; j < color_count; ++j)
+        {
+          m_tone.apply (planes[j], n);
+        }
+    }
+
+  // the LUT replaces the transfer function, it maps straight to display RGB
+  if (color_count == 3 && m_lut)
+    {
+      m_lut->apply (planes, n);
+      return;
+    }
+  for (size_t j = 0; j < color_count; ++j)
+    {
+      m_curve.apply (planes[j], n);
+    }
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Row kernels
+
+
+size_t convert_rows (const DisplayTransform          &transform,
+                     const LocalToneMap              *local,
+                     const std::vector<ChannelInput> &input,
+                     const size_t                    width,
+                     const size_t                    y_begin,
+                     const size_t                    y_end,
+                     guchar                          *output,
+                     guchar                          *mask)
+{
+  // channels of one data type get the kernel with their load inlined
+  int type = input[0].m_channel->get_pixel_data_type();
+  for (size_t j = 1; j < input.size(); ++j)
+    {
+      if (input[j].m_channel->get_pixel_data_type() != type)
+        {
+          type = MIXED_TYPES;
+        }
+    }
+  return CONVERT_KERNELS[type][input.size() - 1] (transform,
+                                                  local,
+                                                  &input[0],
+                                                  width,
+                                                  y_begin,
+                                                  y_end,
+                                                  output,
+                                                  mask);
+}
+
+
+// Works a row at a time: each chroma row is upsampled horizontally once and
+// then reused for the two output rows it covers.
+size_t chroma_rows (const DisplayTransform          &transform,
+                    const LocalToneMap              *local,
+                    const ImagePrecision            precision,
+                    const ChromaFilter              filter,
+                    const float                     yw[3],
+                    const size_t                    width,
+                    const size_t                    height,
+                    const size_t                    y_begin,
+                    const size_t                    y_end,
+                    const std::vector<ChannelInput> &input,
+                    guchar                          *output,
+                    guchar                          *mask,
+                    float                           *scratch)
+{
+  if (width == 0 || y_begin >= y_end)
+    {
+      return 0;
+    }
+
+  const size_t row_bytes     = width * input.size() * get_sample_size (precision);
+  const size_t chroma_height = (height + 1) / 2;
+
+  // row buffers
+  float  *chroma  = scratch;
+  float  *cur_ry  = scratch + width * 1;
+  float  *cur_by  = scratch + width * 2;
+  float  *next_ry = scratch + width * 3;
+  float  *next_by = scratch + width * 4;
+  float  *mid_ry  = scratch + width * 5;
+  float  *mid_by  = scratch + width * 6;
+  float  *lum     = scratch + width * 7;
+  float  *rgba[4] = { scratch + width * 8,  scratch + width * 9,
+                      scratch + width * 10, scratch + width * 11 };
+  guchar *flags   = (guchar*)(scratch + width * 12);
+  memset (flags, 0, width);
+
+  size_t count = 0;
+  for (size_t k = y_begin / 2; 2 * k < y_end; ++k)
+    {
+      const size_t y         = 2 * k;
+      guchar       *out      = output + (y - y_begin) * row_bytes;
+      guchar       *row_mask = mask ? mask + (y - y_begin) * width : NULL;
+
+      // bilinear filtering carries the chroma over from the previous odd row
+      if (k == y_begin / 2 || filter == CHROMA_FILTER_NEAREST)
+        {
+          load_chroma_row (filter, input[1], k, width, chroma, cur_ry);
+          load_chroma_row (filter, input[2], k, width, chroma, cur_by);
+        }
+
+      // even row sits on the chroma samples
+      count += yca_row (transform, local, precision, yw, input, y, width, cur_ry, cur_by,
+                        lum, rgba, flags, out, row_mask);
+
+      if (y + 1 >= y_end)
+        {
+          break;
+        }
+
+      // odd row is in between two chroma rows
+      out      += row_bytes;
+      row_mask  = mask ? row_mask + width : NULL;
+      if (filter == CHROMA_FILTER_BILINEAR)
+        {
+          const size_t next_k = std::min (k + 1, chroma_height - 1);
+          load_chroma_row (filter, input[1], next_k, width, chroma, next_ry);
+          load_chroma_row (filter, input[2], next_k, width, chroma, next_by);
+          blend_rows (cur_ry, next_ry, width, mid_ry);
+          blend_rows (cur_by, next_by, width, mid_by);
+          count += yca_row (transform, local, precision, yw, input, y + 1, width, mid_ry, mid_by,
+                            lum, rgba, flags, out, row_mask);
+          std::swap (cur_ry, next_ry);
+          std::swap (cur_by, next_by);
+        }
+      else
+        {
+          count += yca_row (transform, local, precision, yw, input, y + 1, width, cur_ry, cur_by,
+                            lum, rgba, flags, out, row_mask);
+        }
+    }
+  return count;
+}
+
+
+// Half and float channels that go out in their own format are interleaved
+// straight from the file's rows, anything else is loaded as floats first.
+void linear_rows (const ImagePrecision            precision,
+                  const std::vector<ChannelInput> &input,
+                  const size_t                    width,
+                  const size_t                    y_begin,
+                  const size_t                    y_end,
+                  guchar                          *output)
+{
+  const size_t             channel_count = input.size();
+  const size_t             row_bytes     = width * channel_count * get_sample_size (precision);
+  const exr::PixelDataType same          = precision == IMAGE_PRECISION_HALF
+                                           ? exr::PIXEL_DATA_TYPE_HALF
+                                           : exr::PIXEL_DATA_TYPE_FLOAT;
+  float                    buffer[KERNEL_CHUNK];
+  for (size_t y = y_begin; y < y_end; ++y)
+    {
+      guchar *out = output + (y - y_begin) * row_bytes;
+      for (size_t j = 0; j < channel_count; ++j)
+        {
+          const ChannelInput &channel = input[j];
+          const char         *data    = channel.get_row (y);
+          if (channel.m_channel->get_pixel_data_type() == same)
+            {
+              if (same == exr::PIXEL_DATA_TYPE_HALF)
+                {
+                  interleave ((const half*)data, width, channel_count, (half*)out + j);
+                }
+              else
+                {
+                  interleave ((const float*)data, width, channel_count, (float*)out + j);
+                }
+              continue;
+            }
+
+          for (size_t x = 0; x < width; x += KERNEL_CHUNK)
+            {
+              const size_t n = std::min (KERNEL_CHUNK, width - x);
+              channel.load (y, x, n, buffer);
+              if (precision == IMAGE_PRECISION_HALF)
+                {
+                  interleave_half (buffer, n, channel_count, (half*)out + x * channel_count + j);
+                }
+              else
+                {
+                  interleave (buffer, n, channel_count, (float*)out + x * channel_count + j);
+                }
+            }
+        }
+    }
+}
+
+
+void id_rows (const ChannelInput &input,
+              const size_t       width,
+              const size_t       y_begin,
+              const size_t       y_end,
+              guchar             *output)
+{
+  for (size_t y = y_begin; y < y_end; ++y)
+    {
+      id_to_rgb ((const unsigned int*)input.get_row (y),
+                 width,
+                 output + (y - y_begin) * width * 3);
+    }
+}
+
+
+
+/* vim: set ts=2 sw=2 : */
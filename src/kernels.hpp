@@ -0,0 +1,234 @@
+#ifndef _KERNELS_HPP_
+#define _KERNELS_HPP_ 1
+
+// system includes
+#include <vector>
+// GIMP includes
+#include <glib.h>
+// plugin includes
+#include "conversion.hpp"
+#include "dither.hpp"
+#include "exr_file.hpp"
+#include "lut.hpp"
+#include "tone.hpp"
+#include "transfer.hpp"
+
+class LocalToneMap;
+
+
+//-----------------------------------------------------------------------------
+// Loads a run of samples of one channel as floats and maps them with
+// scale * x + bias. Each channel gets its own loader, so layers can mix data
+// types (e.g. half color with float alpha).
+typedef void (*SampleLoader)(const char   *data,
+                             const size_t first,
+                             const size_t n,
+                             const float  scale,
+                             const float  bias,
+                             float        *out);
+
+
+//-----------------------------------------------------------------------------
+// A channel together with the loader for its data type. Integer channels
+// are normalized by their range when the input is created, float and half
+// channels are loaded as-is.
+struct ChannelInput
+{
+  const exr::Channel *m_channel;
+  SampleLoader       m_load;
+  float              m_scale;
+  float              m_bias;
+  // false for integer channels, which can't hold NaN or infinities
+  bool               m_non_finite;
+  // row slot of the channel the rows are read from
+  size_t             m_slot;
+
+  // Sets up the input for a channel. Integer channels are normalized by
+  // the range in the statistics of the channel when they were gathered over
+  // the whole image (see File::read_statistics()), else by the range of the
+  // rows in slot 0. Not when normalize is false, e.g. for id layers that
+  // are hashed and never loaded as floats.
+  ChannelInput (const exr::Channel *channel,
+                const bool         normalize = true);
+
+  // Returns the raw data of image row y.
+  const char* get_row (const size_t y) const;
+
+  // Loads n samples of image row y starting at sample x.
+  void load (const size_t y,
+             const size_t x,
+             const size_t n,
+             float        *out) const;
+};
+
+
+inline const char* ChannelInput::get_row (const size_t y) const
+{
+  return m_channel->get_row (y, m_slot);
+}
+
+
+inline void ChannelInput::load (const size_t y,
+                                const size_t x,
+                                const size_t n,
+                                float        *out) const
+{
+  m_load (get_row (y), x, n, m_scale, m_bias, out);
+}
+
+
+// Builds the inputs for a list of channels. A channel listed more than once
+// (e.g. Y for R, G and B) is only set up once.
+void make_channel_inputs (const std::vector<const exr::Channel*> &channels,
+                          std::vector<ChannelInput>              &input,
+                          const bool                             normalize = true);
+
+
+// Points all inputs at a row slot of their channels.
+void set_input_slot (std::vector<ChannelInput> &input,
+                     const size_t              slot);
+
+
+
+//-----------------------------------------------------------------------------
+// Maps linear HDR values of the color channels to display values: convert RGB
+// to the sRGB primaries, undo the premultiplication by alpha, apply exposure
+// and the tone operator and then the transfer function, or the 3D LUT for
+// RGB when there is one.
+// Alpha is left linear. Non-finite samples have to be sanitized first. Also
+// holds the dither pattern used when the values are quantized.
+class DisplayTransform
+{
+public:
+
+  // Sets up the transform from the user settings, the chromaticities are
+  // the ones of the file. lut is an optional view LUT, it must outlive the
+  // transform.
+  DisplayTransform (const ConversionSettings  &settings,
+                    const exr::Chromaticities &chromaticities,
+                    const Lut3D               *lut = NULL);
+
+  // Replaces the NaN and infinite values among n values according to the
+  // policy, sets flags[i] to 1 for each one that was replaced and returns
+  // true when there was any.
+  bool sanitize (float        *values,
+                 const size_t n,
+                 guchar       *flags) const;
+
+  // Transforms n values of each of the color planes in place. alpha holds
+  // the n matching alpha values, or is NULL for layers without alpha. Only
+  // three color planes (RGB) are converted to sRGB primaries.
+  void apply (float *const  *planes,
+              const size_t  color_count,
+              const float   *alpha,
+              const size_t  n) const;
+
+  // Returns the dither offsets for image row y, see DitherPattern.
+  const float* get_dither_row (const size_t y) const;
+
+private:
+
+  // linear exposure multiplier
+  float           m_exposure;
+  // true when colors are divided by alpha
+  bool            m_unpremultiply;
+  // replacement of non-finite samples
+  NonFinitePolicy m_non_finite_policy;
+  // true when RGB is converted to sRGB primaries, by m_primaries
+  bool            m_convert_primaries;
+  float           m_primaries[3][3];
+  // global tone mapping
+  ToneCurve       m_tone;
+  // display encoding
+  TransferCurve   m_curve;
+  // view LUT for RGB, or NULL
+  const Lut3D     *m_lut;
+  // dithering of the 8-bit values
+  DitherPattern   m_dither;
+};
+
+
+inline const float* DisplayTransform::get_dither_row (const size_t y) const
+{
+  return m_dither.get_row (y);
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Row kernels. Each converts image rows [y_begin, y_end) into interleaved
+// pixels, 8-bit unless noted otherwise. output points at the first pixel of
+// row y_begin and rows are packed without padding. The channels must hold
+// the rows.
+//
+// The float kernels sanitize NaN and infinite samples and return the number
+// of pixels that had any. When mask isn't NULL it holds a byte per pixel of
+// the rows, which is set to 1 for those pixels and left alone otherwise.
+// When local isn't NULL it compresses the luminance before the transform.
+
+
+// Converts 1 to 4 channels, the 2 and 4 channel layouts end with alpha.
+size_t convert_rows (const DisplayTransform          &transform,
+                     const LocalToneMap              *local,
+                     const std::vector<ChannelInput> &input,
+                     const size_t                    width,
+                     const size_t                    y_begin,
+                     const size_t                    y_end,
+                     guchar                          *output,
+                     guchar                          *mask);
+
+
+// Reconstructs RGB(A) from Y, RY, BY and optionally A channels. y_begin
+// must be even. With bilinear filtering the chroma channels must also hold
+// the samples of row y_end, unless it's past the last row. With a high
+// precision the linear RGB(A) is stored as it is, as half or float samples,
+// and neither transform nor local are used. The row buffers are taken from
+// scratch, get_chroma_scratch_size (width) floats, so a caller converting
+// band after band allocates them once.
+size_t chroma_rows (const DisplayTransform          &transform,
+                    const LocalToneMap              *local,
+                    const ImagePrecision            precision,
+                    const ChromaFilter              filter,
+                    const float                     yw[3],
+                    const size_t                    width,
+                    const size_t                    height,
+                    const size_t                    y_begin,
+                    const size_t                    y_end,
+                    const std::vector<ChannelInput> &input,
+                    guchar                          *output,
+                    guchar                          *mask,
+                    float                           *scratch);
+
+
+// Returns the number of floats of scratch chroma_rows() needs for rows of
+// width pixels: twelve float rows and a row of flag bytes.
+inline size_t get_chroma_scratch_size (const size_t width)
+{
+  return width * 12 + (width + sizeof(float) - 1) / sizeof(float);
+}
+
+
+// Interleaves 1 to 4 channels into linear half or float pixels as they
+// are, for high precision images. Nothing is transformed, integer channels
+// are normalized like for 8-bit images.
+void linear_rows (const ImagePrecision            precision,
+                  const std::vector<ChannelInput> &input,
+                  const size_t                    width,
+                  const size_t                    y_begin,
+                  const size_t                    y_end,
+                  guchar                          *output);
+
+
+// Maps an integer id channel to RGB with a distinct colour per id.
+void id_rows (const ChannelInput &input,
+              const size_t       width,
+              const size_t       y_begin,
+              const size_t       y_end,
+              guchar             *output);
+
+
+
+#endif // #ifndef _KERNELS_HPP_
+
+
+/* vim: set ts=2 sw=2 : */
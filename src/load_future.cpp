@@ -0,0 +1,90 @@
+// plugin includes
+#include "exr_file.hpp"
+// myself
+#include "load_future.hpp"
+
+using namespace exr;
+
+
+//-----------------------------------------------------------------------------
+// Implementation of LoadFuture
+
+
+LoadFuture::LoadFuture (File &file)
+:
+  m_file (file),
+  m_progress (file.get_progress()),
+  m_success (false),
+  m_done (0),
+  m_worker (NULL)
+{
+  if (!m_progress)
+    {
+      m_progress = &m_own_progress;
+      m_file.set_progress (m_progress);
+    }
+  m_worker = new WorkerThread<LoadFuture> (*this, &LoadFuture::load);
+}
+
+
+LoadFuture::~LoadFuture ()
+{
+  cancel ();
+  std::string error_msg;
+  wait (error_msg);
+}
+
+
+double LoadFuture::get_progress () const
+{
+  return m_progress->get_fraction();
+}
+
+
+bool LoadFuture::is_done () const
+{
+  return g_atomic_int_get (&m_done) != 0;
+}
+
+
+void LoadFuture::cancel ()
+{
+  if (!is_done())
+    {
+      m_progress->cancel();
+    }
+}
+
+
+bool LoadFuture::wait (std::string &error_msg)
+{
+  if (m_worker)
+    {
+      // the thread is gone after this, none of our members are touched
+      // any more
+      delete m_worker;
+      m_worker = NULL;
+
+      // the file outlives us, our own progress doesn't
+      if (m_file.get_progress() == &m_own_progress)
+        {
+          m_file.set_progress (NULL);
+        }
+    }
+  if (!m_success)
+    {
+      error_msg = m_error;
+    }
+  return m_success;
+}
+
+
+void LoadFuture::load ()
+{
+  m_success = m_file.load (m_error);
+  g_atomic_int_set (&m_done, 1);
+}
+
+
+
+/* vim: set ts=2 sw=2 : */
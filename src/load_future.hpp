@@ -0,0 +1,82 @@
+#ifndef _LOAD_FUTURE_HPP_
+#define _LOAD_FUTURE_HPP_ 1
+
+// system includes
+#include <string>
+// GIMP includes
+#include <glib.h>
+// plugin includes
+#include "load_progress.hpp"
+#include "worker_thread.hpp"
+
+
+namespace exr
+{
+
+class File;
+
+
+//-----------------------------------------------------------------------------
+// Handle to a file being loaded on a thread of its own, see
+// File::load_async(). The rows are counted in the progress set on the file,
+// or in one of the future's own when there is none, and the load can be
+// cancelled at any time, e.g. when a frame of a sequence won't be looked at
+// after all. The decoding itself still runs on the global thread pool.
+//
+// Only decoding happens on the thread: the GIMP calls of a conversion stay
+// on the thread that talks to GIMP, once the load is done.
+class LoadFuture
+{
+public:
+
+  // Starts loading the file.
+  explicit LoadFuture (File &file);
+
+  // Cancels the load unless it's done, and joins the thread.
+  ~LoadFuture ();
+
+  // Returns the fraction of the rows loaded so far.
+  double get_progress () const;
+
+  // Checks if the load is done, successfully or not, without waiting.
+  bool is_done () const;
+
+  // Asks the load to stop. It fails soon after, between two chunks of rows.
+  void cancel ();
+
+  // Waits for the load to be done and joins the thread.
+  //
+  // @param[out]  error_msg
+  //  error message, only set when the load failed
+  // @return
+  //  true when the file was loaded, false when loading failed or was
+  //  cancelled
+  bool wait (std::string &error_msg);
+
+private:
+
+  // Loads the file, runs on the thread.
+  void load ();
+
+  File                     &m_file;
+  // progress of the file, or m_own_progress when it has none
+  LoadProgress             *m_progress;
+  LoadProgress             m_own_progress;
+  // outcome of the load, only read once the thread is joined
+  bool                     m_success;
+  std::string              m_error;
+  // set when the load is done
+  volatile gint            m_done;
+  // thread loading the file, NULL once joined
+  WorkerThread<LoadFuture> *m_worker;
+};
+
+
+
+} // namespace exr
+
+
+#endif // #ifndef _LOAD_FUTURE_HPP_
+
+
+/* vim: set ts=2 sw=2 : */
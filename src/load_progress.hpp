@@ -0,0 +1,104 @@
+#ifndef _LOAD_PROGRESS_HPP_
+#define _LOAD_PROGRESS_HPP_ 1
+
+// system includes
+#include <cstddef>
+// GIMP includes
+#include <glib.h>
+
+
+//-----------------------------------------------------------------------------
+// Progress and cancellation of a load, shared between the threads doing the
+// work and the one watching it. The work is counted in rows: the decoder
+// adds the rows it decoded, the converter the rows it uploaded. Each count
+// is a single atomic add per band, so reporting costs nothing next to the
+// band itself; watchers only ever read.
+//
+// Cancelling only sets a flag: the workers check it between bands, stop
+// and fail with an error message saying so.
+class LoadProgress
+{
+public:
+
+  // Creates the progress of a load that hasn't started.
+  LoadProgress ();
+
+  // Adds rows still to be done, e.g. by a step about to start. Steps add
+  // theirs as they're planned, so one progress can follow a whole load
+  // made of several of them.
+  void expect (const size_t rows);
+
+  // Adds rows that are done. Safe to call from any thread.
+  void add (const size_t rows);
+
+  // Returns the fraction of the rows done, in [0, 1].
+  double get_fraction () const;
+
+  // Asks the load to stop. Safe to call from any thread.
+  void cancel ();
+
+  // Checks if the load was asked to stop.
+  bool is_cancelled () const;
+
+private:
+
+  volatile gint m_total;
+  volatile gint m_done;
+  volatile gint m_cancelled;
+
+  // not copyable
+  LoadProgress (const LoadProgress&);
+  LoadProgress& operator= (const LoadProgress&);
+};
+
+
+inline LoadProgress::LoadProgress ()
+:
+  m_total (0),
+  m_done (0),
+  m_cancelled (0)
+{}
+
+
+inline void LoadProgress::expect (const size_t rows)
+{
+  g_atomic_int_add (&m_total, (gint)rows);
+}
+
+
+inline void LoadProgress::add (const size_t rows)
+{
+  g_atomic_int_add (&m_done, (gint)rows);
+}
+
+
+inline double LoadProgress::get_fraction () const
+{
+  const gint total = g_atomic_int_get (&m_total);
+  const gint done  = g_atomic_int_get (&m_done);
+  if (total <= 0)
+    {
+      return 0.0;
+    }
+  // bands that overlap by a row count that row twice
+  return done < total ? (double)done / (double)total : 1.0;
+}
+
+
+inline void LoadProgress::cancel ()
+{
+  g_atomic_int_set (&m_cancelled, 1);
+}
+
+
+inline bool LoadProgress::is_cancelled () const
+{
+  return g_atomic_int_get (&m_cancelled) != 0;
+}
+
+
+
+#endif // #ifndef _LOAD_PROGRESS_HPP_
+
+
+/* vim: set ts=2 sw=2 : */
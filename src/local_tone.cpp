@@ -0,0 +1,396 @@
+// system includes
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+// OpenEXR includes
+#include <IlmThreadPool.h>
+// plugin includes
+#include "fast_math.hpp"
+#include "kernels.hpp"
+#include "luminance.hpp"
+// myself
+#include "local_tone.hpp"
+
+
+//-----------------------------------------------------------------------------
+// Helpers
+
+
+// Cells of zero padding around the grid, so the blur and the trilinear
+// lookups never need bounds checks.
+static const size_t PAD = 2;
+
+
+// Weight of the luminance a cell stands for in its base, in pixels, so
+// cells few pixels were blurred into don't get an arbitrary base.
+static const float EMPTY_WEIGHT = 1.f;
+
+
+// Fraction of the pixels ignored at either end when measuring the base
+// contrast, so a few highlights don't dictate the compression.
+static const float CONTRAST_PERCENTILE = 0.01f;
+
+
+// Number of cells needed to cover [0, extent] with cells of the given size,
+// plus one for the trilinear lookup and the padding.
+static size_t grid_cells (const float extent,
+                          const float inv_cell)
+{
+  return (size_t)(extent * inv_cell + 0.5f) + 2 + 2 * PAD;
+}
+
+
+// Splats rows [y_begin, y_end) of a layer into a grid of its own, and
+// counts them into a histogram of its own when there is one.
+class SplatTask : public IlmThread::Task
+{
+public:
+
+  SplatTask (IlmThread::TaskGroup            *group,
+             const std::vector<ChannelInput> &input,
+             const std::vector<float>        &weights,
+             const size_t                    width,
+             const size_t                    y_begin,
+             const size_t                    y_end,
+             const float                     inv_cell_size,
+             const float                     inv_cell_range,
+             const size_t                    grid_width,
+             const size_t                    grid_height,
+             std::vector<float>              &grid,
+             LuminanceHistogram              *histogram)
+  :
+    IlmThread::Task (group),
+    m_input (input),
+    m_weights (weights),
+    m_width (width),
+    m_y_begin (y_begin),
+    m_y_end (y_end),
+    m_inv_cell_size (inv_cell_size),
+    m_inv_cell_range (inv_cell_range),
+    m_grid_width (grid_width),
+    m_grid_height (grid_height),
+    m_grid (grid),
+    m_histogram (histogram)
+  {}
+
+  virtual void execute()
+  {
+    std::vector<float> scratch (m_width);
+    std::vector<float> luminance (m_width);
+    for (size_t y = m_y_begin; y < m_y_end; ++y)
+      {
+        load_log_luminance (m_input, m_weights, y, m_width, &scratch[0], &luminance[0]);
+        if (m_histogram)
+          {
+            m_histogram->add (&luminance[0], m_width);
+          }
+
+        // nearest cell, the blur afterwards smooths it out
+        const size_t row = (size_t)(y * m_inv_cell_size + 0.5f) + PAD;
+        for (size_t i = 0; i < m_width; ++i)
+          {
+            const float  l      = luminance[i];
+            const size_t column = (size_t)(i * m_inv_cell_size + 0.5f) + PAD;
+            const size_t depth  = (size_t)((l - LOG_LUMINANCE_MIN) * m_inv_cell_range + 0.5f) + PAD;
+            const size_t cell   = ((depth * m_grid_height + row) * m_grid_width + column) * 2;
+            m_grid[cell]     += l;
+            m_grid[cell + 1] += 1.f;
+          }
+      }
+  }
+
+private:
+
+  const std::vector<ChannelInput> &m_input;
+  const std::vector<float>        &m_weights;
+  const size_t                    m_width;
+  const size_t                    m_y_begin;
+  const size_t                    m_y_end;
+  const float                     m_inv_cell_size;
+  const float                     m_inv_cell_range;
+  const size_t                    m_grid_width;
+  const size_t                    m_grid_height;
+  std::vector<float>              &m_grid;
+  LuminanceHistogram              *m_histogram;
+};
+
+
+// Blurs the (sum, weight) pairs of a grid with a [1 4 6 4 1] / 16 kernel
+// along each axis, which approximates a Gaussian of one cell.
+static void blur_grid (std::vector<float> &grid,
+                       const size_t       size[3])
+{
+  static const float KERNEL[5] = { 0.0625f, 0.25f, 0.375f, 0.25f, 0.0625f };
+
+  const size_t       stride[3] = { 2, 2 * size[0], 2 * size[0] * size[1] };
+  std::vector<float> blurred (grid.size());
+  for (int axis = 0; axis < 3; ++axis)
+    {
+      for (size_t z = 0; z < size[2]; ++z)
+        {
+          for (size_t y = 0; y < size[1]; ++y)
+            {
+              for (size_t x = 0; x < size[0]; ++x)
+                {
+                  const size_t coordinate[3] = { x, y, z };
+                  const size_t cell          = z * stride[2] + y * stride[1] + x * stride[0];
+                  float        sum           = 0.f;
+                  float        weight        = 0.f;
+                  for (int k = -2; k <= 2; ++k)
+                    {
+                      const size_t c = coordinate[axis] + k;
+                      if (c < size[axis])
+                        {
+                          const size_t from = cell + k * (ptrdiff_t)stride[axis];
+                          sum              += KERNEL[k + 2] * grid[from];
+                          weight           += KERNEL[k + 2] * grid[from + 1];
+                        }
+                    }
+                  blurred[cell]     = sum;
+                  blurred[cell + 1] = weight;
+                }
+            }
+        }
+      grid.swap (blurred);
+    }
+}
+
+
+// Slices the grid for n pixels of one row and scales them, COLORS is 1 or 3.
+template<size_t COLORS>
+static void slice_row (const float  *__restrict__ grid,
+                       const size_t              grid_width,
+                       const size_t              grid_height,
+                       const float               inv_cell_size,
+                       const float               inv_cell_range,
+                       const float               weights[3],
+                       float *const              *planes,
+                       const size_t              x,
+                       const size_t              y,
+                       const size_t              n)
+{
+  // the row is the same for all pixels
+  const float fy     = y * inv_cell_size + PAD;
+  const int   iy     = (int)fy;
+  const float ty     = fy - (float)iy;
+  const int   step_y = (int)grid_width;
+  const int   step_z = (int)(grid_width * grid_height);
+  const int   row    = iy * step_y;
+  const float w0     = weights[0];
+  const float w1     = weights[1];
+  const float w2     = weights[2];
+
+  const int   x0     = (int)x;
+
+  float *__restrict__ r = planes[0];
+  float *__restrict__ g = COLORS == 3 ? planes[1] : NULL;
+  float *__restrict__ b = COLORS == 3 ? planes[2] : NULL;
+  for (int i = 0; i < (int)n; ++i)
+    {
+      const float luminance = COLORS == 3 ? w0 * r[i] + w1 * g[i] + w2 * b[i] : r[i];
+      const float l         = min_value (max_value (fast_log2 (max_value (luminance, 0.f)),
+                                                    LOG_LUMINANCE_MIN),
+                                         LOG_LUMINANCE_MAX);
+
+      const float fx = (float)(x0 + i) * inv_cell_size + PAD;
+      const float fz = (l - LOG_LUMINANCE_MIN) * inv_cell_range + PAD;
+      const int   ix = (int)fx;
+      const int   iz = (int)fz;
+      const float tx = fx - (float)ix;
+      const float tz = fz - (float)iz;
+
+      // trilinear interpolation of the log2 scale
+      const int   c   = iz * step_z + row + ix;
+      const float s00 = grid[c]                   + tx * (grid[c + 1]                   - grid[c]);
+      const float s10 = grid[c + step_y]          + tx * (grid[c + step_y + 1]          - grid[c + step_y]);
+      const float s01 = grid[c + step_z]          + tx * (grid[c + step_z + 1]          - grid[c + step_z]);
+      const float s11 = grid[c + step_z + step_y] + tx * (grid[c + step_z + step_y + 1] - grid[c + step_z + step_y]);
+      const float s0  = s00 + ty * (s10 - s00);
+      const float s1  = s01 + ty * (s11 - s01);
+      const float scale = fast_exp2 (s0 + tz * (s1 - s0));
+
+      r[i] *= scale;
+      if (COLORS == 3)
+        {
+          g[i] *= scale;
+          b[i] *= scale;
+        }
+    }
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Implementation of LocalToneMap
+
+
+LocalToneMap::LocalToneMap()
+:
+  m_grid_width (0),
+  m_grid_height (0),
+  m_grid_depth (0),
+  m_inv_cell_size (1.f),
+  m_inv_cell_range (1.f)
+{
+  m_weights[0] = m_weights[1] = m_weights[2] = 0.f;
+}
+
+
+void LocalToneMap::build (const std::vector<ChannelInput> &input,
+                          const std::vector<float>        &weights,
+                          const float                     color_weights[3],
+                          const size_t                    width,
+                          const size_t                    height,
+                          const ConversionSettings        &settings,
+                          LuminanceHistogram              *histogram)
+{
+  for (int i = 0; i < 3; ++i)
+    {
+      m_weights[i] = color_weights[i];
+    }
+
+  // one cell per spatial sigma and per range sigma
+  const float cell_size = std::max (settings.m_local_spatial_sigma *
+                                    (float)std::max (width, height),
+                                    4.f);
+  m_inv_cell_size  = 1.f / cell_size;
+  m_inv_cell_range = 1.f / settings.m_local_range_sigma;
+  m_grid_width     = grid_cells ((float)width,  m_inv_cell_size);
+  m_grid_height    = grid_cells ((float)height, m_inv_cell_size);
+  m_grid_depth     = grid_cells (LOG_LUMINANCE_MAX - LOG_LUMINANCE_MIN, m_inv_cell_range);
+  const size_t cells = m_grid_width * m_grid_height * m_grid_depth;
+
+  // each slice of rows splats into a grid of its own, they are summed after
+  const size_t threads = IlmThread::ThreadPool::globalThreadPool().numThreads();
+  const size_t slices  = std::max (std::min (threads, height), (size_t)1);
+  const size_t rows    = (height + slices - 1) / slices;
+  std::vector< std::vector<float> > grids (slices, std::vector<float> (2 * cells, 0.f));
+  std::vector<LuminanceHistogram>   histograms (histogram ? slices : 0);
+  {
+    IlmThread::TaskGroup group;
+    for (size_t k = 0; k < slices; ++k)
+      {
+        const size_t y_begin = std::min (k * rows, height);
+        const size_t y_end   = std::min (y_begin + rows, height);
+        IlmThread::ThreadPool::addGlobalTask (
+            new SplatTask (&group,
+                           input,
+                           weights,
+                           width,
+                           y_begin,
+                           y_end,
+                           m_inv_cell_size,
+                           m_inv_cell_range,
+                           m_grid_width,
+                           m_grid_height,
+                           grids[k],
+                           histogram ? &histograms[k] : NULL));
+      }
+  }
+  m_grid.swap (grids[0]);
+  for (size_t k = 1; k < slices; ++k)
+    {
+      for (size_t i = 0; i < m_grid.size(); ++i)
+        {
+          m_grid[i] += grids[k][i];
+        }
+    }
+  for (size_t k = 0; k < histograms.size(); ++k)
+    {
+      histogram->merge (histograms[k]);
+    }
+
+  // the log-average is kept in place, it comes from the unblurred grid
+  std::vector<float> counts (cells);
+  double             total_sum    = 0.0;
+  double             total_weight = 0.0;
+  for (size_t i = 0; i < cells; ++i)
+    {
+      counts[i]     = m_grid[2 * i + 1];
+      total_sum    += m_grid[2 * i];
+      total_weight += m_grid[2 * i + 1];
+    }
+  const float anchor = total_weight > 0.0 ? (float)(total_sum / total_weight) : 0.f;
+
+  const size_t size[3] = { m_grid_width, m_grid_height, m_grid_depth };
+  blur_grid (m_grid, size);
+
+  // base log luminance per cell, cells with little weight lean towards the
+  // luminance they stand for, so isolated pixels get the global compression
+  std::vector<float> base (cells);
+  for (size_t i = 0; i < cells; ++i)
+    {
+      const size_t z      = i / (m_grid_width * m_grid_height);
+      const float  center = LOG_LUMINANCE_MIN + ((float)z - (float)PAD) * settings.m_local_range_sigma;
+      base[i]             = (m_grid[2 * i] + EMPTY_WEIGHT * center) /
+                            (m_grid[2 * i + 1] + EMPTY_WEIGHT);
+    }
+
+  // base contrast between the low and high percentiles of the pixels
+  std::vector< std::pair<float, float> > occupied;
+  for (size_t i = 0; i < cells; ++i)
+    {
+      if (counts[i] > 0.f)
+        {
+          occupied.push_back (std::make_pair (base[i], counts[i]));
+        }
+    }
+  std::sort (occupied.begin(), occupied.end());
+
+  float  base_low  = 0.f;
+  float  base_high = 0.f;
+  double seen      = 0.0;
+  for (size_t i = 0; i < occupied.size(); ++i)
+    {
+      const double before = seen;
+      seen               += occupied[i].second;
+      if (before <= CONTRAST_PERCENTILE * total_weight)
+        {
+          base_low = occupied[i].first;
+        }
+      if (seen <= (1.0 - CONTRAST_PERCENTILE) * total_weight || i == 0)
+        {
+          base_high = occupied[i].first;
+        }
+    }
+
+  const float range       = base_high - base_low;
+  const float compression = range > settings.m_local_contrast
+                            ? settings.m_local_contrast / range
+                            : 1.f;
+
+  // the grid keeps the log2 scale, so a lookup is one trilinear
+  // interpolation and an exp2 per pixel
+  m_grid.resize (cells);
+  for (size_t i = 0; i < cells; ++i)
+    {
+      m_grid[i] = (base[i] - anchor) * (compression - 1.f);
+    }
+}
+
+
+void LocalToneMap::apply (float *const *planes,
+                          const size_t color_count,
+                          const size_t x,
+                          const size_t y,
+                          const size_t n) const
+{
+  if (color_count == 3)
+    {
+      slice_row<3> (&m_grid[0], m_grid_width, m_grid_height,
+                    m_inv_cell_size, m_inv_cell_range,
+                    m_weights,
+                    planes, x, y, n);
+    }
+  else
+    {
+      slice_row<1> (&m_grid[0], m_grid_width, m_grid_height,
+                    m_inv_cell_size, m_inv_cell_range,
+                    m_weights,
+                    planes, x, y, n);
+    }
+}
+
+
+
+/* vim: set ts=2 sw=2 : */
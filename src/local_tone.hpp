@@ -0,0 +1,84 @@
+#ifndef _LOCAL_TONE_HPP_
+#define _LOCAL_TONE_HPP_ 1
+
+// system includes
+#include <vector>
+
+class LuminanceHistogram;
+struct ChannelInput;
+struct ConversionSettings;
+
+
+//-----------------------------------------------------------------------------
+// Local tone mapping after Durand and Dorsey (2002): log luminance is split
+// into a base layer, an edge-preserving blur of it, and the detail on top.
+// Only the base is compressed, so large contrasts (a window in an interior)
+// shrink while local contrast and texture stay intact.
+//
+// The bilateral filter is approximated with a bilateral grid (Chen, Paris
+// and Durand, 2007): log luminance is splatted into a coarse 3D grid over
+// (x, y, log luminance), the grid is blurred with a small separable kernel
+// and each pixel reads its base back with a trilinear lookup. The grid has
+// a cell per spatial sigma and per range sigma, so building it is one pass
+// over the pixels, split over the threads of the global pool, plus a blur
+// of a few thousand cells. The compression keeps the log-average luminance
+// in place, exposure and the display transform follow as usual.
+class LocalToneMap
+{
+public:
+
+  // Creates an empty map, apply() must not be called before build().
+  LocalToneMap ();
+
+  // Builds the grid for a layer from its luminance.
+  //
+  // @param[in]   input
+  //  channels that make up the luminance, they must hold all rows
+  // @param[in]   weights
+  //  weight of each input in the luminance
+  // @param[in]   color_weights
+  //  luminance weights of the RGB planes later passed to apply()
+  // @param[in]   width, height
+  //  size of the image in pixels
+  // @param[in]   settings
+  //  contrast and filter sizes
+  // @param[in,out] histogram
+  //  when not NULL the luminance is also counted into it, which saves
+  //  metering the layer in a pass of its own
+  void build (const std::vector<ChannelInput> &input,
+              const std::vector<float>        &weights,
+              const float                     color_weights[3],
+              const size_t                    width,
+              const size_t                    height,
+              const ConversionSettings        &settings,
+              LuminanceHistogram              *histogram = NULL);
+
+  // Scales n linear pixels of row y, starting at column x, so their base
+  // luminance is compressed. There are 1 (gray) or 3 (RGB) color planes.
+  void apply (float *const *planes,
+              const size_t color_count,
+              const size_t x,
+              const size_t y,
+              const size_t n) const;
+
+private:
+
+  // grid size in cells, including the padding for the blur
+  size_t             m_grid_width;
+  size_t             m_grid_height;
+  size_t             m_grid_depth;
+  // log2 of the scale per cell, z-major
+  std::vector<float> m_grid;
+  // pixels per cell and stops per cell, inverted
+  float              m_inv_cell_size;
+  float              m_inv_cell_range;
+  // luminance weights of the RGB planes
+  float              m_weights[3];
+};
+
+
+
+#endif // #ifndef _LOCAL_TONE_HPP_
+
+
+/* vim: set ts=2 sw=2 : */
@@ -0,0 +1,203 @@
+// system includes
+#include <algorithm>
+// OpenEXR includes
+#include <IlmThreadPool.h>
+// plugin includes
+#include "fast_math.hpp"
+#include "kernels.hpp"
+// myself
+#include "luminance.hpp"
+
+
+//-----------------------------------------------------------------------------
+// Helpers
+
+
+// Bins per stop of the histogram.
+static const float BINS_PER_STOP = 16.f;
+
+
+// Number of bins, the top one holds LOG_LUMINANCE_MAX.
+static const size_t BIN_COUNT =
+  (size_t)((LOG_LUMINANCE_MAX - LOG_LUMINANCE_MIN) * BINS_PER_STOP) + 1;
+
+
+// Counts rows [y_begin, y_end) of an image into a histogram of its own.
+class HistogramTask : public IlmThread::Task
+{
+public:
+
+  HistogramTask (IlmThread::TaskGroup            *group,
+                 const std::vector<ChannelInput> &input,
+                 const std::vector<float>        &weights,
+                 const size_t                    width,
+                 const size_t                    y_begin,
+                 const size_t                    y_end,
+                 LuminanceHistogram              &histogram)
+  :
+    IlmThread::Task (group),
+    m_input (input),
+    m_weights (weights),
+    m_width (width),
+    m_y_begin (y_begin),
+    m_y_end (y_end),
+    m_histogram (histogram)
+  {}
+
+  virtual void execute()
+  {
+    std::vector<float> scratch (m_width);
+    std::vector<float> luminance (m_width);
+    for (size_t y = m_y_begin; y < m_y_end; ++y)
+      {
+        load_log_luminance (m_input, m_weights, y, m_width, &scratch[0], &luminance[0]);
+        m_histogram.add (&luminance[0], m_width);
+      }
+  }
+
+private:
+
+  const std::vector<ChannelInput> &m_input;
+  const std::vector<float>        &m_weights;
+  const size_t                    m_width;
+  const size_t                    m_y_begin;
+  const size_t                    m_y_end;
+  LuminanceHistogram              &m_histogram;
+};
+
+
+
+//-----------------------------------------------------------------------------
+// Implementation of the free functions
+
+
+void load_log_luminance (const std::vector<ChannelInput> &input,
+                         const std::vector<float>        &weights,
+                         const size_t                    y,
+                         const size_t                    width,
+                         float                           *scratch,
+                         float                           *out)
+{
+  std::fill (out, out + width, 0.f);
+  for (size_t k = 0; k < input.size(); ++k)
+    {
+      const float weight = weights[k];
+      input[k].load (y, 0, width, scratch);
+      for (size_t i = 0; i < width; ++i)
+        {
+          out[i] += weight * scratch[i];
+        }
+    }
+  for (size_t i = 0; i < width; ++i)
+    {
+      const float l = fast_log2 (max_value (out[i], 0.f));
+      out[i]        = min_value (max_value (l, LOG_LUMINANCE_MIN), LOG_LUMINANCE_MAX);
+    }
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Implementation of LuminanceHistogram
+
+
+LuminanceHistogram::LuminanceHistogram()
+:
+  m_counts (BIN_COUNT, 0)
+{}
+
+
+void LuminanceHistogram::add (const float  *log_luminance,
+                              const size_t n)
+{
+  for (size_t i = 0; i < n; ++i)
+    {
+      const size_t bin = (size_t)((log_luminance[i] - LOG_LUMINANCE_MIN) * BINS_PER_STOP);
+      ++m_counts[std::min (bin, BIN_COUNT - 1)];
+    }
+}
+
+
+void LuminanceHistogram::merge (const LuminanceHistogram &other)
+{
+  for (size_t i = 0; i < BIN_COUNT; ++i)
+    {
+      m_counts[i] += other.m_counts[i];
+    }
+}
+
+
+void LuminanceHistogram::add_rows (const std::vector<ChannelInput> &input,
+                                   const std::vector<float>        &weights,
+                                   const size_t                    width,
+                                   const size_t                    y_begin,
+                                   const size_t                    y_end)
+{
+  const size_t height  = y_end - y_begin;
+  const size_t threads = IlmThread::ThreadPool::globalThreadPool().numThreads();
+  const size_t slices  = std::max (std::min (threads, height), (size_t)1);
+  const size_t rows    = (height + slices - 1) / slices;
+  std::vector<LuminanceHistogram> histograms (slices);
+  {
+    IlmThread::TaskGroup group;
+    for (size_t k = 0; k < slices; ++k)
+      {
+        const size_t slice_begin = std::min (y_begin + k * rows, y_end);
+        const size_t slice_end   = std::min (slice_begin + rows, y_end);
+        IlmThread::ThreadPool::addGlobalTask (
+            new HistogramTask (&group,
+                               input,
+                               weights,
+                               width,
+                               slice_begin,
+                               slice_end,
+                               histograms[k]));
+      }
+  }
+  for (size_t k = 0; k < slices; ++k)
+    {
+      merge (histograms[k]);
+    }
+}
+
+
+void LuminanceHistogram::add_image (const std::vector<ChannelInput> &input,
+                                    const std::vector<float>        &weights,
+                                    const size_t                    width,
+                                    const size_t                    height)
+{
+  add_rows (input, weights, width, 0, height);
+}
+
+
+float LuminanceHistogram::get_percentile (const float p) const
+{
+  // the lowest bin holds black
+  size_t total = 0;
+  for (size_t i = 1; i < BIN_COUNT; ++i)
+    {
+      total += m_counts[i];
+    }
+  if (total == 0)
+    {
+      return 0.f;
+    }
+
+  const double target = std::min (std::max ((double)p, 0.0), 1.0) * total;
+  size_t       seen   = 0;
+  for (size_t i = 1; i < BIN_COUNT; ++i)
+    {
+      // interpolate within the bin the percentile falls in
+      if (seen + m_counts[i] >= target && m_counts[i] > 0)
+        {
+          const float fraction = (float)((target - seen) / m_counts[i]);
+          return LOG_LUMINANCE_MIN + ((float)i + fraction) / BINS_PER_STOP;
+        }
+      seen += m_counts[i];
+    }
+  return LOG_LUMINANCE_MAX;
+}
+
+
+
+/* vim: set ts=2 sw=2 : */
@@ -0,0 +1,94 @@
+#ifndef _LUMINANCE_HPP_
+#define _LUMINANCE_HPP_ 1
+
+// system includes
+#include <vector>
+
+struct ChannelInput;
+
+
+//-----------------------------------------------------------------------------
+// Range of log2 luminance the luminance statistics cover, values outside it
+// are clamped. The lower end doubles as the value of black.
+const float LOG_LUMINANCE_MIN = -24.f;
+const float LOG_LUMINANCE_MAX = 24.f;
+
+
+// Loads image row y of the weighted sum of some channels as log2 luminance,
+// clamped to [LOG_LUMINANCE_MIN, LOG_LUMINANCE_MAX].
+//
+// @param[in]   input
+//  channels that make up the luminance, they must hold row y
+// @param[in]   weights
+//  weight of each input in the luminance
+// @param[in]   y, width
+//  row to load and its number of pixels
+// @param[in]   scratch
+//  room for width floats
+// @param[out]  out
+//  width log2 luminance values
+void load_log_luminance (const std::vector<ChannelInput> &input,
+                         const std::vector<float>        &weights,
+                         const size_t                    y,
+                         const size_t                    width,
+                         float                           *scratch,
+                         float                           *out);
+
+
+//-----------------------------------------------------------------------------
+// Histogram of log2 luminance with 1/16 stop bins. Black pixels land in the
+// lowest bin and are left out of the percentiles, so a frame on a black
+// background meters on its subject.
+class LuminanceHistogram
+{
+public:
+
+  // Creates an empty histogram.
+  LuminanceHistogram ();
+
+  // Counts n log2 luminance values as loaded by load_log_luminance().
+  void add (const float  *log_luminance,
+            const size_t n);
+
+  // Adds the counts of another histogram.
+  void merge (const LuminanceHistogram &other);
+
+  // Counts rows [y_begin, y_end) of an image, e.g. a band just decoded.
+  // The rows are split over the threads of the global pool, each counting
+  // into a histogram of its own, and those are merged at the end.
+  //
+  // @param[in]   input, weights
+  //  channels that make up the luminance and their weights, the channels
+  //  must hold the rows
+  // @param[in]   width
+  //  width of the image in pixels
+  // @param[in]   y_begin, y_end
+  //  rows to count
+  void add_rows (const std::vector<ChannelInput> &input,
+                 const std::vector<float>        &weights,
+                 const size_t                    width,
+                 const size_t                    y_begin,
+                 const size_t                    y_end);
+
+  // Counts all rows of an image, see add_rows().
+  void add_image (const std::vector<ChannelInput> &input,
+                  const std::vector<float>        &weights,
+                  const size_t                    width,
+                  const size_t                    height);
+
+  // Returns the log2 luminance below which the fraction p of the non-black
+  // pixels lies, or 0 when there are none.
+  float get_percentile (const float p) const;
+
+private:
+
+  // pixels per bin
+  std::vector<size_t> m_counts;
+};
+
+
+
+#endif // #ifndef _LUMINANCE_HPP_
+
+
+/* vim: set ts=2 sw=2 : */
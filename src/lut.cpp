@@ -0,0 +1,300 @@
+// system includes
+#include <fstream>
+#include <sstream>
+// plugin includes
+#include "fast_math.hpp"
+// myself
+#include "lut.hpp"
+
+
+//-----------------------------------------------------------------------------
+// Helpers
+
+
+// Largest supported .cube size, keeps indices in 32 bits.
+static const size_t MAX_LUT_SIZE = 256;
+
+
+// log2 of 18% gray, the anchor of the log2 shaper.
+static const float LOG2_MID_GRAY = -2.473931188f;
+
+
+// Picks the tetrahedron around a point of a cube cell. The fractions are
+// sorted as a >= b >= c; the path from corner 000 to 111 first steps along
+// the axis of a, then along the axis of b. step1 and step2 are the table
+// offsets of the two corners in between.
+static inline void tetrahedron (const float fr,
+                                const float fg,
+                                const float fb,
+                                const int   sr,
+                                const int   sg,
+                                const int   sb,
+                                float       &a,
+                                float       &b,
+                                float       &c,
+                                int         &step1,
+                                int         &step2)
+{
+  // bitwise rather than logical operators, && would introduce branches
+  const int rg = fr >= fg;
+  const int gb = fg >= fb;
+  const int rb = fr >= fb;
+
+  const int r_max = rg & rb;
+  const int g_max = (rg ^ 1) & gb;
+  const int r_min = (rg | rb) ^ 1;
+  const int g_min = rg & (gb ^ 1);
+
+  a     = max_value (fr, max_value (fg, fb));
+  c     = min_value (fr, min_value (fg, fb));
+  b     = fr + fg + fb - a - c;
+  step1 = r_max ? sr : (g_max ? sg : sb);
+  step2 = sr + sg + sb - (r_min ? sr : (g_min ? sg : sb));
+}
+
+
+
+// Maps a value to a table coordinate in [0, size - 1] and splits it into
+// the index of the cell, at most size - 2, and the fraction within it.
+template<bool LOG2>
+static inline void cell (const float x,
+                         const float scale,
+                         const float bias,
+                         const float max_pos,
+                         const int   max_index,
+                         int         &index,
+                         float       &fraction)
+{
+  const float shaped = LOG2 ? fast_log2 (max_value (x, 0.f)) : x;
+  const float pos    = min_value (max_value (shaped * scale + bias, 0.f), max_pos);
+  const int   i      = (int)pos;
+  index              = i < max_index ? i : max_index;
+  fraction           = pos - (float)index;
+}
+
+
+// Looks up n pixels with tetrahedral interpolation, LOG2 selects the shaper
+// at compile time so the loop body has no branches.
+template<bool LOG2>
+static void lookup (const float *__restrict__ table,
+                    const size_t             size,
+                    const float              scale[3],
+                    const float              bias[3],
+                    float *const             *planes,
+                    const size_t             n)
+{
+  const int   sr        = 3;
+  const int   sg        = 3 * (int)size;
+  const int   sb        = 3 * (int)(size * size);
+  const float max_pos   = (float)(size - 1);
+  const int   max_index = (int)size - 2;
+  const float scale_r   = scale[0], scale_g = scale[1], scale_b = scale[2];
+  const float bias_r    = bias[0],  bias_g  = bias[1],  bias_b  = bias[2];
+  // the planes never overlap each other or the table, telling the compiler
+  // lets it turn the table reads into gathers
+  float *__restrict__ pr = planes[0];
+  float *__restrict__ pg = planes[1];
+  float *__restrict__ pb = planes[2];
+  for (size_t i = 0; i < n; ++i)
+    {
+      int   ir, ig, ib;
+      float fr, fg, fb;
+      cell<LOG2> (pr[i], scale_r, bias_r, max_pos, max_index, ir, fr);
+      cell<LOG2> (pg[i], scale_g, bias_g, max_pos, max_index, ig, fg);
+      cell<LOG2> (pb[i], scale_b, bias_b, max_pos, max_index, ib, fb);
+
+      float a, b, c;
+      int   step1, step2;
+      tetrahedron (fr, fg, fb, sr, sg, sb, a, b, c, step1, step2);
+
+      const int   i0 = ir * sr + ig * sg + ib * sb;
+      const int   i1 = i0 + step1;
+      const int   i2 = i0 + step2;
+      const int   i3 = i0 + sr + sg + sb;
+      const float w0 = 1.f - a;
+      const float w1 = a - b;
+      const float w2 = b - c;
+      pr[i] = w0 * table[i0]     + w1 * table[i1]     + w2 * table[i2]     + c * table[i3];
+      pg[i] = w0 * table[i0 + 1] + w1 * table[i1 + 1] + w2 * table[i2 + 1] + c * table[i3 + 1];
+      pb[i] = w0 * table[i0 + 2] + w1 * table[i1 + 2] + w2 * table[i2 + 2] + c * table[i3 + 2];
+    }
+}
+
+
+
+//-----------------------------------------------------------------------------
+// Implementation of Lut3D
+
+
+Lut3D::Lut3D()
+:
+  m_size (0),
+  m_shaper (LUT_SHAPER_NONE),
+  m_min_stops (-6.5f),
+  m_max_stops (6.5f)
+{
+  for (int i = 0; i < 3; ++i)
+    {
+      m_domain_min[i] = 0.f;
+      m_domain_max[i] = 1.f;
+    }
+}
+
+
+bool Lut3D::load (const std::string &path,
+                  std::string       &error_msg)
+{
+  std::ifstream in (path.c_str());
+  if (!in)
+    {
+      error_msg = "can't open LUT " + path;
+      return false;
+    }
+
+  size_t             size = 0;
+  std::vector<float> table;
+  float              domain_min[3] = { 0.f, 0.f, 0.f };
+  float              domain_max[3] = { 1.f, 1.f, 1.f };
+  std::string        line;
+  while (std::getline (in, line))
+    {
+      std::istringstream fields (line);
+      std::string        keyword;
+      if (!(fields >> keyword) || keyword[0] == '#')
+        {
+          continue;
+        }
+
+      if (keyword == "TITLE")
+        {
+          continue;
+        }
+      else if (keyword == "LUT_3D_SIZE")
+        {
+          if (!(fields >> size) || size < 2 || size > MAX_LUT_SIZE)
+            {
+              error_msg = "unsupported LUT_3D_SIZE in " + path;
+              return false;
+            }
+          table.reserve (size * size * size * 3);
+        }
+      else if (keyword == "LUT_1D_SIZE")
+        {
+          error_msg = "1D LUTs are not supported: " + path;
+          return false;
+        }
+      else if (keyword == "DOMAIN_MIN" || keyword == "DOMAIN_MAX")
+        {
+          float *domain = keyword == "DOMAIN_MIN" ? domain_min : domain_max;
+          if (!(fields >> domain[0] >> domain[1] >> domain[2]))
+            {
+              error_msg = "malformed " + keyword + " in " + path;
+              return false;
+            }
+        }
+      else if (keyword == "LUT_3D_INPUT_RANGE")
+        {
+          float lo, hi;
+          if (!(fields >> lo >> hi))
+            {
+              error_msg = "malformed " + keyword + " in " + path;
+              return false;
+            }
+          for (int i = 0; i < 3; ++i)
+            {
+              domain_min[i] = lo;
+              domain_max[i] = hi;
+            }
+        }
+      else
+        {
+          // a table row
+          std::istringstream values (line);
+          float              rgb[3];
+          if (!(values >> rgb[0] >> rgb[1] >> rgb[2]))
+            {
+              error_msg = "unexpected line '" + line + "' in " + path;
+              return false;
+            }
+          table.insert (table.end(), rgb, rgb + 3);
+        }
+    }
+
+  if (size == 0 || table.size() != size * size * size * 3)
+    {
+      error_msg = "LUT_3D_SIZE doesn't match the table in " + path;
+      return false;
+    }
+  for (int i = 0; i < 3; ++i)
+    {
+      if (!(domain_max[i] > domain_min[i]))
+        {
+          error_msg = "empty domain in " + path;
+          return false;
+        }
+    }
+
+  m_size = size;
+  m_table.swap (table);
+  for (int i = 0; i < 3; ++i)
+    {
+      m_domain_min[i] = domain_min[i];
+      m_domain_max[i] = domain_max[i];
+    }
+  return true;
+}
+
+
+void Lut3D::set_shaper (const LutShaper shaper,
+                        const float     min_stops,
+                        const float     max_stops)
+{
+  m_shaper    = shaper;
+  m_min_stops = min_stops;
+  m_max_stops = max_stops;
+}
+
+
+// The shaper and the domain fold into one multiply-add per channel on either
+// the value or its log2, followed by the scale to table coordinates.
+void Lut3D::apply (float *const *planes,
+                   const size_t n) const
+{
+  if (m_size == 0)
+    {
+      return;
+    }
+
+  const bool  log2_shaper = m_shaper == LUT_SHAPER_LOG2;
+  const float last        = (float)(m_size - 1);
+
+  // coordinate = (shaped - domain_min) / (domain_max - domain_min) * last
+  float scale[3];
+  float bias[3];
+  for (int i = 0; i < 3; ++i)
+    {
+      float shape_scale = 1.f;
+      float shape_bias  = 0.f;
+      if (log2_shaper)
+        {
+          shape_scale = 1.f / (m_max_stops - m_min_stops);
+          shape_bias  = -(LOG2_MID_GRAY + m_min_stops) * shape_scale;
+        }
+      const float range = m_domain_max[i] - m_domain_min[i];
+      scale[i]          = shape_scale / range * last;
+      bias[i]           = (shape_bias - m_domain_min[i]) / range * last;
+    }
+
+  if (log2_shaper)
+    {
+      lookup<true> (&m_table[0], m_size, scale, bias, planes, n);
+    }
+  else
+    {
+      lookup<false> (&m_table[0], m_size, scale, bias, planes, n);
+    }
+}
+
+
+
+/* vim: set ts=2 sw=2 : */
@@ -0,0 +1,87 @@
+#ifndef _LUT_HPP_
+#define _LUT_HPP_ 1
+
+// system includes
+#include <string>
+#include <vector>
+
+
+//-----------------------------------------------------------------------------
+// Maps scene-linear values onto the input range of a 3D LUT.
+enum LutShaper
+{
+  // the LUT covers the linear range given by its DOMAIN_MIN/DOMAIN_MAX
+  LUT_SHAPER_NONE = 0,
+  // the LUT is indexed by log2 of the value relative to 18% gray, scaled
+  // from [min stops, max stops] to [0, 1] (like an OCIO lg2 allocation)
+  LUT_SHAPER_LOG2 = 1,
+};
+
+
+//-----------------------------------------------------------------------------
+// A 3D LUT loaded from a .cube file (Adobe/Resolve format), used as a view
+// transform: it takes linear RGB and gives display RGB in [0, 1].
+//
+// Lookups use tetrahedral interpolation, which only blends the 4 corners of
+// the tetrahedron around the input instead of the 8 of the cube, and keeps
+// the neutral axis exact. The tetrahedron is picked with selects rather than
+// branches, so the loop vectorizes on targets with gathers (e.g. -mavx2) and
+// stays branch-free otherwise.
+class Lut3D
+{
+public:
+
+  // Creates an empty LUT.
+  Lut3D ();
+
+  // Loads a .cube file. Only 3D LUTs are supported.
+  //
+  // @param[in]   path
+  //  path of the .cube file
+  // @param[out]  error_msg
+  //  error message, only filled in when something went wrong
+  // @return
+  //  true on success, false on failure
+  bool load (const std::string &path,
+             std::string       &error_msg);
+
+  // Sets the shaper, stops are relative to 18% gray and only used by
+  // LUT_SHAPER_LOG2.
+  void set_shaper (const LutShaper shaper,
+                   const float     min_stops,
+                   const float     max_stops);
+
+  // Returns the number of samples along each axis, 0 when nothing is loaded.
+  size_t get_size() const;
+
+  // Transforms n pixels of three planes (R, G, B) in place.
+  void apply (float *const *planes,
+              const size_t n) const;
+
+private:
+
+  // samples along each axis
+  size_t             m_size;
+  // RGB triplets, red changing fastest
+  std::vector<float> m_table;
+  // linear input range per channel
+  float              m_domain_min[3];
+  float              m_domain_max[3];
+  // shaper and its range
+  LutShaper          m_shaper;
+  float              m_min_stops;
+  float              m_max_stops;
+};
+
+
+inline size_t Lut3D::get_size() const
+{
+  return m_size;
+}
+
+
+
+#endif // #ifndef _LUT_HPP_
+
+
+/* vim: set ts=2 sw=2 : */
@@ -1,17 +1,36 @@
 // C includes
 #include <stdlib.h>
 #include <string.h>
+// C++ includes
+#include <algorithm>
+#include <string>
+#include <vector>
 // GIMP includes
 #include <libgimp/gimp.h>
 #include <libgimp/gimpui.h>
+#if GIMP_CHECK_VERSION (2, 10, 0)
+#include <gegl.h>
+#endif
 // plugin includes
 #include "conversion.hpp"
 #include "exr_file.hpp"
+#include "load_progress.hpp"
+#include "thread_pool.hpp"
 
 // list of comma seperated file extensions that work for OpenEXR
 static const char *FILE_EXTENSIONS = "exr,EXR";
 // name of the load procedure in the PDB
 static const char *LOAD_PROCEDURE = "file-exr-load";
+// name of the channel statistics procedure in the PDB
+static const char *STATISTICS_PROCEDURE = "file-exr-channel-statistics";
+// name of the plugin binary, for gimp_ui_init()
+static const char *PLUG_IN_BINARY = "gimp-exr-plugin";
+// role of the progress dialog
+static const char *PROGRESS_ROLE = "file-exr-progress";
+// interval at which the progress dialog is updated, in microseconds
+static const gulong PROGRESS_POLL_INTERVAL = 20000;
+// time a load runs before the progress dialog shows up, in microseconds
+static const gint64 PROGRESS_DIALOG_DELAY = 500000;
 
 
 // Returns plugin info to the GIMP.
@@ -59,11 +78,267 @@ query (void)
                           G_N_ELEMENTS(load_return_vals),
                           load_args,
                           load_return_vals);
+
+  static GimpParamDef statistics_args[] =
+  {
+    {
+      GIMP_PDB_INT32,
+      "run-mode",
+      "Run mode"
+    },
+    {
+      GIMP_PDB_STRING,
+      "filename",
+      "The name of the file to read"
+    }
+  };
+
+  // every array is preceded by its length, as the PDB wants
+  static GimpParamDef statistics_return_vals[] =
+  {
+    { GIMP_PDB_INT32,       "num-channels",        "Number of channels" },
+    { GIMP_PDB_STRINGARRAY, "channel-names",       "Full channel names, e.g. diffuse.R" },
+    { GIMP_PDB_INT32,       "num-minimums",        "Number of channels" },
+    { GIMP_PDB_FLOATARRAY,  "minimums",            "Smallest finite sample per channel" },
+    { GIMP_PDB_INT32,       "num-maximums",        "Number of channels" },
+    { GIMP_PDB_FLOATARRAY,  "maximums",            "Largest finite sample per channel" },
+    { GIMP_PDB_INT32,       "num-means",           "Number of channels" },
+    { GIMP_PDB_FLOATARRAY,  "means",               "Mean of the finite samples per channel" },
+    { GIMP_PDB_INT32,       "num-nan-counts",      "Number of channels" },
+    { GIMP_PDB_INT32ARRAY,  "nan-counts",          "NaN samples per channel, at most 2^31-1" },
+    { GIMP_PDB_INT32,       "num-infinity-counts", "Number of channels" },
+    { GIMP_PDB_INT32ARRAY,  "infinity-counts",     "Infinite samples per channel, at most 2^31-1" },
+  };
+
+  gimp_install_procedure (STATISTICS_PROCEDURE,
+                          "OpenEXR channel statistics",
+                          "Reads an OpenEXR file and returns the minimum, "
+                          "maximum, mean and number of NaN and infinite "
+                          "samples of each channel. Channels without finite "
+                          "samples report 0 for the minimum, maximum and "
+                          "mean. The pixels aren't kept, so this is cheap "
+                          "enough to check renders in batch.",
+                          "Thomas Loockx",
+                          "Thomas Loockx",
+                          "2014",
+                          NULL,
+                          NULL,
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS(statistics_args),
+                          G_N_ELEMENTS(statistics_return_vals),
+                          statistics_args,
+                          statistics_return_vals);
+
   gimp_register_file_handler_mime (LOAD_PROCEDURE, "image/x-exr");
   gimp_register_load_handler (LOAD_PROCEDURE, FILE_EXTENSIONS, "");
 }
 
 
+// Sets up the thread pool shared by decoding and conversion with the number
+// of processors set in GIMP's preferences.
+static void
+init_threads (void)
+{
+  int   threads = 1;
+  gchar *value  = gimp_gimprc_query ("num-processors");
+  if (value)
+    {
+      threads = atoi (value);
+      g_free (value);
+    }
+  init_thread_pool (threads);
+}
+
+
+// Runs the statistics procedure: reads the file a band at a time and
+// returns the statistics of its channels.
+static void
+run_statistics (gint              nparams,
+                const GimpParam  *param,
+                gint             *nreturn_vals,
+                GimpParam       **return_vals)
+{
+  // the return values have to outlive this call
+  static GimpParam                return_values[13];
+  static std::vector<std::string> names;
+  static std::vector<gchar*>      name_pointers;
+  static std::vector<gdouble>     minimums;
+  static std::vector<gdouble>     maximums;
+  static std::vector<gdouble>     means;
+  static std::vector<gint32>      nan_counts;
+  static std::vector<gint32>      infinity_counts;
+
+  names.clear();
+  name_pointers.clear();
+  minimums.clear();
+  maximums.clear();
+  means.clear();
+  nan_counts.clear();
+  infinity_counts.clear();
+
+  return_values[0].type          = GIMP_PDB_STATUS;
+  return_values[0].data.d_status = GIMP_PDB_CALLING_ERROR;
+  *return_vals                   = return_values;
+  *nreturn_vals                  = 1;
+  if (nparams < 2)
+    {
+      return;
+    }
+
+  GimpPDBStatusType status    = GIMP_PDB_SUCCESS;
+  exr::File         file (param[1].data.d_string);
+  std::string       error_msg = "";
+
+  init_threads ();
+
+  file.set_gather_statistics (true);
+  if (!file.open (error_msg) || !file.read_statistics (error_msg))
+    {
+      g_message("%s\n", error_msg.c_str());
+      status = GIMP_PDB_EXECUTION_ERROR;
+    }
+  else
+    {
+      for (size_t i = 0; i < file.get_layer_count(); ++i)
+        {
+          const exr::Layer *layer = file.get_layer_at (i);
+          for (size_t j = 0; j < layer->get_channel_count(); ++j)
+            {
+              const exr::Channel           *channel    = layer->get_channel_at (j);
+              const exr::ChannelStatistics &statistics = channel->get_statistics();
+              const bool                   finite      = statistics.get_finite_count() > 0;
+              names.push_back (layer->get_name().empty()
+                               ? channel->get_name()
+                               : layer->get_name() + "." + channel->get_name());
+              minimums.push_back (finite ? statistics.m_min : 0.0);
+              maximums.push_back (finite ? statistics.m_max : 0.0);
+              means.push_back (statistics.get_mean());
+              // the PDB only has 32-bit integer arrays, larger counts
+              // saturate instead of wrapping around
+              nan_counts.push_back ((gint32)std::min (statistics.m_nan_count,
+                                                      (size_t)G_MAXINT32));
+              infinity_counts.push_back ((gint32)std::min (statistics.m_infinity_count,
+                                                           (size_t)G_MAXINT32));
+            }
+        }
+      for (size_t i = 0; i < names.size(); ++i)
+        {
+          name_pointers.push_back ((gchar*)names[i].c_str());
+        }
+    }
+
+  const gint32 count = (gint32)names.size();
+  return_values[0].type               = GIMP_PDB_STATUS;
+  return_values[0].data.d_status      = status;
+  *return_vals                        = return_values;
+  *nreturn_vals                       = 1;
+  if (status != GIMP_PDB_SUCCESS)
+    {
+      return;
+    }
+
+  return_values[1].type               = GIMP_PDB_INT32;
+  return_values[1].data.d_int32       = count;
+  return_values[2].type               = GIMP_PDB_STRINGARRAY;
+  return_values[2].data.d_stringarray = count ? &name_pointers[0] : NULL;
+  return_values[3].type               = GIMP_PDB_INT32;
+  return_values[3].data.d_int32       = count;
+  return_values[4].type               = GIMP_PDB_FLOATARRAY;
+  return_values[4].data.d_floatarray  = count ? &minimums[0] : NULL;
+  return_values[5].type               = GIMP_PDB_INT32;
+  return_values[5].data.d_int32       = count;
+  return_values[6].type               = GIMP_PDB_FLOATARRAY;
+  return_values[6].data.d_floatarray  = count ? &maximums[0] : NULL;
+  return_values[7].type               = GIMP_PDB_INT32;
+  return_values[7].data.d_int32       = count;
+  return_values[8].type               = GIMP_PDB_FLOATARRAY;
+  return_values[8].data.d_floatarray  = count ? &means[0] : NULL;
+  return_values[9].type               = GIMP_PDB_INT32;
+  return_values[9].data.d_int32       = count;
+  return_values[10].type              = GIMP_PDB_INT32ARRAY;
+  return_values[10].data.d_int32array = count ? &nan_counts[0] : NULL;
+  return_values[11].type              = GIMP_PDB_INT32;
+  return_values[11].data.d_int32      = count;
+  return_values[12].type              = GIMP_PDB_INT32ARRAY;
+  return_values[12].data.d_int32array = count ? &infinity_counts[0] : NULL;
+  *nreturn_vals                       = 13;
+}
+
+
+// Cancels the conversion when the progress dialog is answered, through its
+// Cancel button or by closing it.
+static void
+cancel_conversion (GtkWidget *dialog,
+                   gint       response_id,
+                   gpointer   data)
+{
+  ((ConvertFuture*)data)->cancel();
+}
+
+
+// Converts on a thread of its own while a dialog shows the progress and
+// offers to cancel. GIMP's own progress isn't started: its Cancel ends the
+// plugin process, which leaves the partial image behind, while cancelling
+// here stops the conversion at the next band and deletes the image. The
+// dialog only shows up once the load has taken a while.
+//
+// @param[in]   converter
+//  converter of the open file
+// @param[in]   title
+//  title of the dialog
+// @param[out]  image_id
+//  id of the new image, only valid when we return true
+// @param[out]  error_msg
+//  error message, only set when the conversion failed
+// @return
+//  true on success, false when the conversion failed or was cancelled
+static bool
+convert_interactive (Converter   &converter,
+                     const gchar *title,
+                     gint32      &image_id,
+                     std::string &error_msg)
+{
+  ConvertFuture *future = converter.convert_async ();
+
+  GtkWidget *dialog  = gimp_dialog_new (title, PROGRESS_ROLE, NULL,
+                                        (GtkDialogFlags)0, NULL, NULL,
+                                        GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+                                        NULL);
+  GtkWidget *content = gtk_dialog_get_content_area (GTK_DIALOG (dialog));
+  GtkWidget *bar     = gtk_progress_bar_new ();
+  gtk_container_set_border_width (GTK_CONTAINER (content), 12);
+  gtk_progress_bar_set_text (GTK_PROGRESS_BAR (bar), title);
+  gtk_box_pack_start (GTK_BOX (content), bar, FALSE, FALSE, 0);
+  g_signal_connect (dialog, "response", G_CALLBACK (cancel_conversion), future);
+
+  const gint64 start = g_get_monotonic_time ();
+  bool         shown = false;
+  while (!future->is_done())
+    {
+      if (!shown && g_get_monotonic_time () - start >= PROGRESS_DIALOG_DELAY)
+        {
+          gtk_widget_show_all (dialog);
+          shown = true;
+        }
+      if (shown)
+        {
+          gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (bar), future->get_progress());
+        }
+      while (gtk_events_pending ())
+        {
+          gtk_main_iteration ();
+        }
+      g_usleep (PROGRESS_POLL_INTERVAL);
+    }
+
+  // no more responses once the dialog is gone
+  gtk_widget_destroy (dialog);
+  const bool success = future->wait (image_id, error_msg);
+  delete future;
+  return success;
+}
+
+
 // Runs the plugin.
 static void
 run (const gchar      *name,
@@ -72,6 +347,12 @@ run (const gchar      *name,
      gint             *nreturn_vals,
      GimpParam       **return_vals)
 {
+  if (strcmp (name, STATISTICS_PROCEDURE) == 0)
+    {
+      run_statistics (nparams, param, nreturn_vals, return_vals);
+      return;
+    }
+
   static GimpParam  return_values[2];
   GimpPDBStatusType status = GIMP_PDB_SUCCESS;
 
@@ -79,28 +360,92 @@ run (const gchar      *name,
   GimpRunMode run_mode  = (GimpRunMode)param[0].data.d_int32;
   gchar       *filename = param[1].data.d_string;
 
-  exr::File   file (filename);
-  std::string error_msg = "";
-  gint32      image_id  = -1;
+  exr::File    file (filename);
+  std::string  error_msg = "";
+  gint32       image_id  = -1;
+  // rows decoded and converted, GIMP's progress bar follows them
+  LoadProgress progress;
+  file.set_progress (&progress);
 
-  // read the exr file
-  if (file.load(error_msg))
+  init_threads ();
+#if GIMP_CHECK_VERSION (2, 10, 0)
+  // high precision layers are written through GEGL buffers
+  gegl_init (NULL, NULL);
+#endif
+
+  // interactive loads show a progress dialog of their own that can cancel
+  // them, others report to GIMP's progress
+  const bool interactive = run_mode == GIMP_RUN_INTERACTIVE;
+  gchar      *basename   = g_path_get_basename (filename);
+  gchar      *message    = g_strdup_printf ("Opening '%s'", basename);
+  g_free (basename);
+  if (interactive)
+    {
+      gimp_ui_init (PLUG_IN_BINARY, FALSE);
+    }
+  else
+    {
+      gimp_progress_init (message);
+    }
+
+  // open the exr file, the converter streams in the pixels
+  if (file.open(error_msg))
     {
       // TODO: configurable settings
       ConversionSettings settings;
 
+      // EXR_UPLOAD_TIMING prints how long writing the layers took, set to
+      // "shadow" the layers go through shadow tiles to compare the two
+      const gchar *upload_timing = g_getenv ("EXR_UPLOAD_TIMING");
+      if (upload_timing != NULL)
+        {
+          settings.m_shadow_upload = (strcmp (upload_timing, "shadow") == 0);
+        }
+
       // create converter and do the conversion
-      Converter converter (file, settings);
-      if (!converter.convert (image_id, error_msg))
+      Converter  converter (file, settings);
+      const bool success = interactive
+                           ? convert_interactive (converter, message, image_id, error_msg)
+                           : converter.convert (image_id, error_msg);
+      if (!success)
+        {
+          // the partial image is gone already
+          if (progress.is_cancelled())
+            {
+              status = GIMP_PDB_CANCEL;
+            }
+          else
+            {
+              g_message("%s\n", error_msg.c_str());
+              status = GIMP_PDB_EXECUTION_ERROR;
+            }
+        }
+      else
         {
-          g_message("%s\n", error_msg.c_str());
-          status = GIMP_PDB_EXECUTION_ERROR;
+          if (upload_timing != NULL)
+            {
+              g_printerr ("%s: %s upload took %.3f s\n",
+                          PLUG_IN_BINARY,
+                          settings.m_shadow_upload ? "shadow" : "direct",
+                          converter.get_upload_time());
+            }
+          if (converter.get_non_finite_count() > 0)
+            {
+              g_message("%lu pixels had NaN or infinite values, they were "
+                        "replaced\n",
+                        (unsigned long)converter.get_non_finite_count());
+            }
         }
     }
   else
     {
       status = GIMP_PDB_EXECUTION_ERROR;
     }
+  if (!interactive)
+    {
+      gimp_progress_end ();
+    }
+  g_free (message);
 
   // fill in the return values (status & image id)
   return_values[0].type          = GIMP_PDB_STATUS;
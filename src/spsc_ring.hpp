@@ -0,0 +1,217 @@
+#ifndef _SPSC_RING_HPP_
+#define _SPSC_RING_HPP_ 1
+
+// system includes
+#include <vector>
+// GIMP includes
+#include <glib.h>
+// OpenEXR includes
+#include <IlmThreadSemaphore.h>
+// plugin includes
+#include "aligned_buffer.hpp"
+
+
+//-----------------------------------------------------------------------------
+// Fixed size ring handing items from one producer thread to one consumer
+// thread, e.g. decoded bands from the decoder to the converter. The items
+// are preallocated and reused, and the producer waits while the ring is
+// full, so a stream of any length runs in fixed memory.
+//
+// The two positions only ever grow and each is written by one side, so
+// pushing and popping are an atomic store and load each, without a lock.
+// Only a side that finds the ring full (producer) or empty (consumer) for a
+// while goes to sleep on a semaphore; the other side posts it after its
+// next step when it sees the sleeper's flag. The flag is set before the
+// position is checked once more and the position is stored before the flag
+// is read, both with full barriers, so a wake-up can't get lost.
+template<typename T>
+class SpscRing
+{
+public:
+
+  // Creates a ring of capacity default constructed items.
+  explicit SpscRing (const size_t capacity);
+
+  // Returns the number of items in the ring.
+  size_t get_capacity () const;
+
+  // Producer: waits until there is room for an item. Returns false when
+  // the ring was closed.
+  bool wait_for_room ();
+
+  // Producer: returns the item to fill in after wait_for_room().
+  T& get_back ();
+
+  // Producer: hands the item filled in to the consumer.
+  void push ();
+
+  // Consumer: waits until there is an item. Returns false when the ring was
+  // closed and nothing is left.
+  bool wait_for_item ();
+
+  // Consumer: returns the oldest item after wait_for_item(). The item
+  // stays the consumer's, and takes a place in the ring, until pop().
+  T& get_front ();
+
+  // Consumer: gives the oldest item back to the producer.
+  void pop ();
+
+  // Makes all waits fail from now on and wakes up the sides that sleep,
+  // e.g. when the consumer stops early. Either side may call it.
+  void close ();
+
+private:
+
+  // tries before a side goes to sleep, a band takes far longer than this
+  // so they only help when both sides run at the same pace
+  static const int SPIN_COUNT = 1000;
+
+  std::vector<T>       m_items;
+  // number of items popped, written by the consumer only
+  volatile gint        m_head;
+  char                 m_head_padding[BUFFER_ALIGNMENT];
+  // number of items pushed, written by the producer only
+  volatile gint        m_tail;
+  char                 m_tail_padding[BUFFER_ALIGNMENT];
+  // set while a side sleeps, and when the ring is closed
+  volatile gint        m_producer_waiting;
+  volatile gint        m_consumer_waiting;
+  volatile gint        m_closed;
+  // sleeping sides
+  IlmThread::Semaphore m_room;
+  IlmThread::Semaphore m_item;
+
+  // not copyable
+  SpscRing (const SpscRing&);
+  SpscRing& operator= (const SpscRing&);
+};
+
+
+template<typename T>
+SpscRing<T>::SpscRing (const size_t capacity)
+:
+  m_items (capacity),
+  m_head (0),
+  m_tail (0),
+  m_producer_waiting (0),
+  m_consumer_waiting (0),
+  m_closed (0),
+  m_room (0),
+  m_item (0)
+{}
+
+
+template<typename T>
+inline size_t SpscRing<T>::get_capacity () const
+{
+  return m_items.size();
+}
+
+
+template<typename T>
+bool SpscRing<T>::wait_for_room ()
+{
+  for (int spin = 0; ; ++spin)
+    {
+      if (g_atomic_int_get (&m_closed))
+        {
+          return false;
+        }
+      if ((size_t)(m_tail - g_atomic_int_get (&m_head)) < m_items.size())
+        {
+          return true;
+        }
+      if (spin < SPIN_COUNT)
+        {
+          continue;
+        }
+
+      g_atomic_int_set (&m_producer_waiting, 1);
+      if ((size_t)(m_tail - g_atomic_int_get (&m_head)) >= m_items.size() &&
+          !g_atomic_int_get (&m_closed))
+        {
+          m_room.wait();
+        }
+      g_atomic_int_set (&m_producer_waiting, 0);
+    }
+}
+
+
+template<typename T>
+inline T& SpscRing<T>::get_back ()
+{
+  return m_items[(size_t)m_tail % m_items.size()];
+}
+
+
+template<typename T>
+void SpscRing<T>::push ()
+{
+  g_atomic_int_set (&m_tail, m_tail + 1);
+  if (g_atomic_int_get (&m_consumer_waiting))
+    {
+      m_item.post();
+    }
+}
+
+
+template<typename T>
+bool SpscRing<T>::wait_for_item ()
+{
+  for (int spin = 0; ; ++spin)
+    {
+      if (g_atomic_int_get (&m_tail) != m_head)
+        {
+          return true;
+        }
+      if (g_atomic_int_get (&m_closed))
+        {
+          return false;
+        }
+      if (spin < SPIN_COUNT)
+        {
+          continue;
+        }
+
+      g_atomic_int_set (&m_consumer_waiting, 1);
+      if (g_atomic_int_get (&m_tail) == m_head && !g_atomic_int_get (&m_closed))
+        {
+          m_item.wait();
+        }
+      g_atomic_int_set (&m_consumer_waiting, 0);
+    }
+}
+
+
+template<typename T>
+inline T& SpscRing<T>::get_front ()
+{
+  return m_items[(size_t)m_head % m_items.size()];
+}
+
+
+template<typename T>
+void SpscRing<T>::pop ()
+{
+  g_atomic_int_set (&m_head, m_head + 1);
+  if (g_atomic_int_get (&m_producer_waiting))
+    {
+      m_room.post();
+    }
+}
+
+
+template<typename T>
+void SpscRing<T>::close ()
+{
+  g_atomic_int_set (&m_closed, 1);
+  m_room.post();
+  m_item.post();
+}
+
+
+
+#endif // #ifndef _SPSC_RING_HPP_
+
+
+/* vim: set ts=2 sw=2 : */
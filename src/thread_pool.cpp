@@ -0,0 +1,387 @@
+// system includes
+#include <algorithm>
+#include <stddef.h>
+#include <vector>
+// GIMP includes
+#include <glib.h>
+// OpenEXR includes
+#include <IlmBaseConfig.h>
+#include <IlmThread.h>
+#include <IlmThreadMutex.h>
+#include <IlmThreadPool.h>
+#include <IlmThreadSemaphore.h>
+#include <ImfThreading.h>
+// myself
+#include "thread_pool.hpp"
+
+
+// the pool provider interface came with OpenEXR 2.3
+#if defined (ILMBASE_VERSION_HEX) && ILMBASE_VERSION_HEX >= 0x02030000
+#define HAVE_THREAD_POOL_PROVIDER 1
+#endif
+
+
+#ifdef HAVE_THREAD_POOL_PROVIDER
+
+//-----------------------------------------------------------------------------
+// Helpers
+
+
+// Work-stealing pool behind IlmThread's global pool. Tasks are spread
+// round robin over the queues of the workers; a worker runs the tasks of
+// its own queue in order and, when it's empty, steals the newest task of
+// another queue, so a worker that got the slow tasks doesn't hold up the
+// others. One semaphore counts the queued tasks: a worker only sleeps when
+// there is nothing to run anywhere.
+class WorkStealingPool : public IlmThread::ThreadPoolProvider
+{
+public:
+
+  // Starts a pool with the given number of workers.
+  explicit WorkStealingPool (const int threads);
+
+  // Waits for the queued tasks and stops the workers.
+  virtual ~WorkStealingPool ();
+
+  // Returns the number of workers.
+  virtual int numThreads () const;
+
+  // Restarts the pool with another number of workers, once the queued
+  // tasks are done.
+  virtual void setNumThreads (int count);
+
+  // Queues a task, or runs it right away without workers.
+  virtual void addTask (IlmThread::Task *task);
+
+  // Waits for the queued tasks and stops the workers.
+  virtual void finish ();
+
+private:
+
+  class Worker;
+
+  // tasks of a worker, the lock is only held to push or pop. A ring that
+  // only grows, so queueing allocates nothing once it held the most tasks
+  // it's going to hold, e.g. after the first band of a load.
+  struct Queue
+  {
+    Queue ();
+
+    // checks if there are no tasks
+    bool empty () const;
+
+    // adds a task after the newest one
+    void push_back (IlmThread::Task *task);
+
+    // removes and returns the oldest task, the queue must not be empty
+    IlmThread::Task* pop_front ();
+
+    // removes and returns the newest task, the queue must not be empty
+    IlmThread::Task* pop_back ();
+
+    IlmThread::Mutex              m_mutex;
+    std::vector<IlmThread::Task*> m_ring;
+    // index of the oldest task and number of tasks
+    size_t                        m_first;
+    size_t                        m_count;
+  };
+
+  // workers and their queues, changed by the thread that sets the pool up
+  std::vector<Worker*> m_workers;
+  std::vector<Queue*>  m_queues;
+  // guards m_next and m_stopping
+  IlmThread::Mutex     m_mutex;
+  // queue the next task goes to
+  size_t               m_next;
+  // set when the workers have to leave once the queues are empty
+  bool                 m_stopping;
+  // queued tasks, plus a token per worker when stopping
+  IlmThread::Semaphore m_tasks;
+  // workers that left
+  IlmThread::Semaphore m_exited;
+
+  // starts count workers
+  void start (const int count);
+
+  // takes a task for worker index, from its own queue or another one;
+  // returns NULL when all queues are empty
+  IlmThread::Task* take (const size_t index);
+
+  // runs tasks until the pool stops, on worker index
+  void work (const size_t index);
+
+  // returns true when the workers have to leave
+  bool is_stopping ();
+};
+
+
+WorkStealingPool::Queue::Queue ()
+:
+  m_first (0),
+  m_count (0)
+{}
+
+
+bool WorkStealingPool::Queue::empty () const
+{
+  return m_count == 0;
+}
+
+
+void WorkStealingPool::Queue::push_back (IlmThread::Task *task)
+{
+  if (m_count == m_ring.size())
+    {
+      std::vector<IlmThread::Task*> ring (std::max (2 * m_ring.size(), (size_t)16));
+      for (size_t i = 0; i < m_count; ++i)
+        {
+          ring[i] = m_ring[(m_first + i) % m_ring.size()];
+        }
+      m_ring.swap (ring);
+      m_first = 0;
+    }
+  m_ring[(m_first + m_count) % m_ring.size()] = task;
+  ++m_count;
+}
+
+
+IlmThread::Task* WorkStealingPool::Queue::pop_front ()
+{
+  IlmThread::Task *task = m_ring[m_first];
+  m_first = (m_first + 1) % m_ring.size();
+  --m_count;
+  return task;
+}
+
+
+IlmThread::Task* WorkStealingPool::Queue::pop_back ()
+{
+  --m_count;
+  return m_ring[(m_first + m_count) % m_ring.size()];
+}
+
+
+// A thread of the pool.
+class WorkStealingPool::Worker : public IlmThread::Thread
+{
+public:
+
+  Worker (WorkStealingPool &pool,
+          const size_t     index)
+  :
+    m_pool (pool),
+    m_index (index)
+  {
+    start ();
+  }
+
+  virtual void run ()
+  {
+    m_pool.work (m_index);
+  }
+
+private:
+
+  WorkStealingPool &m_pool;
+  const size_t     m_index;
+};
+
+
+WorkStealingPool::WorkStealingPool (const int threads)
+:
+  m_next (0),
+  m_stopping (false),
+  m_tasks (0),
+  m_exited (0)
+{
+  start (threads);
+}
+
+
+WorkStealingPool::~WorkStealingPool ()
+{
+  finish ();
+}
+
+
+int WorkStealingPool::numThreads () const
+{
+  return (int)m_workers.size();
+}
+
+
+void WorkStealingPool::setNumThreads (int count)
+{
+  if (count < 0)
+    {
+      count = 0;
+    }
+  if ((size_t)count != m_workers.size())
+    {
+      finish ();
+      start (count);
+    }
+}
+
+
+void WorkStealingPool::addTask (IlmThread::Task *task)
+{
+  if (m_workers.empty())
+    {
+      // deleting the task tells its group it's done
+      task->execute ();
+      delete task;
+      return;
+    }
+
+  size_t index;
+  {
+    IlmThread::Lock lock (m_mutex);
+    index  = m_next;
+    m_next = (m_next + 1) % m_queues.size();
+  }
+  {
+    IlmThread::Lock lock (m_queues[index]->m_mutex);
+    m_queues[index]->push_back (task);
+  }
+  m_tasks.post ();
+}
+
+
+void WorkStealingPool::finish ()
+{
+  if (m_workers.empty())
+    {
+      return;
+    }
+
+  {
+    IlmThread::Lock lock (m_mutex);
+    m_stopping = true;
+  }
+  for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+      m_tasks.post ();
+    }
+  for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+      m_exited.wait ();
+    }
+
+  for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+      delete m_workers[i];
+      delete m_queues[i];
+    }
+  m_workers.clear();
+  m_queues.clear();
+}
+
+
+void WorkStealingPool::start (const int count)
+{
+  m_stopping = false;
+  m_next     = 0;
+  for (int i = 0; i < count; ++i)
+    {
+      m_queues.push_back (new Queue);
+    }
+  // the queues are all there before the first worker looks at them
+  for (int i = 0; i < count; ++i)
+    {
+      m_workers.push_back (new Worker (*this, i));
+    }
+}
+
+
+IlmThread::Task* WorkStealingPool::take (const size_t index)
+{
+  // oldest task of our own queue first
+  {
+    Queue           &queue = *m_queues[index];
+    IlmThread::Lock lock (queue.m_mutex);
+    if (!queue.empty())
+      {
+        return queue.pop_front();
+      }
+  }
+
+  // then the newest one of the others, starting at our neighbour
+  for (size_t k = 1; k < m_queues.size(); ++k)
+    {
+      Queue           &queue = *m_queues[(index + k) % m_queues.size()];
+      IlmThread::Lock lock (queue.m_mutex);
+      if (!queue.empty())
+        {
+          return queue.pop_back();
+        }
+    }
+  return NULL;
+}
+
+
+bool WorkStealingPool::is_stopping ()
+{
+  IlmThread::Lock lock (m_mutex);
+  return m_stopping;
+}
+
+
+void WorkStealingPool::work (const size_t index)
+{
+  for (;;)
+    {
+      // each token is a queued task, or one worker leaving when stopping
+      m_tasks.wait ();
+
+      // tasks are all queued before the pool stops, so once stopping an
+      // empty scan means there is nothing left
+      const bool      stopping = is_stopping ();
+      IlmThread::Task *task    = take (index);
+      if (!task && stopping)
+        {
+          break;
+        }
+      if (!task)
+        {
+          // another worker took the task of our token while its own one
+          // is still queued; hand the token back and let the others run
+          // before looking again, rather than polling the queues
+          m_tasks.post ();
+          g_thread_yield ();
+          continue;
+        }
+
+      task->execute ();
+      delete task;
+    }
+  m_exited.post ();
+}
+
+#endif // #ifdef HAVE_THREAD_POOL_PROVIDER
+
+
+
+//-----------------------------------------------------------------------------
+// Implementation of the free functions
+
+
+void init_thread_pool (const int threads)
+{
+  const int count = threads > 1 ? threads : 0;
+#ifdef HAVE_THREAD_POOL_PROVIDER
+  static bool installed = false;
+  if (!installed && count > 0 && IlmThread::supportsThreads())
+    {
+      // the global pool owns the provider from now on
+      IlmThread::ThreadPool::globalThreadPool().setThreadProvider (new WorkStealingPool (count));
+      installed = true;
+      return;
+    }
+#endif
+  Imf::setGlobalThreadCount (count);
+}
+
+
+
+/* vim: set ts=2 sw=2 : */
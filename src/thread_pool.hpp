@@ -0,0 +1,25 @@
+#ifndef _THREAD_POOL_HPP_
+#define _THREAD_POOL_HPP_ 1
+
+
+//-----------------------------------------------------------------------------
+// Sets up the one pool of worker threads of the plugin. OpenEXR decodes on
+// IlmThread's global pool and the conversion kernels add their tasks to the
+// same pool, so with a single thread count the plugin never runs more busy
+// threads than that, whatever runs at the same time.
+//
+// With OpenEXR 2.3 and later the global pool is backed by a work-stealing
+// pool of our own: each worker has a queue, tasks are spread over the
+// queues and an idle worker takes tasks from the others before it sleeps.
+// Older versions keep OpenEXR's own pool at the same size.
+//
+// @param[in]   threads
+//  number of worker threads, 0 runs all tasks on the thread adding them
+void init_thread_pool (const int threads);
+
+
+
+#endif // #ifndef _THREAD_POOL_HPP_
+
+
+/* vim: set ts=2 sw=2 : */
@@ -0,0 +1,186 @@
+// system includes
+#include <math.h>
+// plugin includes
+#include "fast_math.hpp"
+// myself
+#include "tone.hpp"
+
+
+//-----------------------------------------------------------------------------
+// Helpers
+
+
+// Exposure exrdisplay adds so 18% gray ends up in the middle of its range.
+static const float KNEE_EXPOSURE_OFFSET = 2.47393f;
+
+
+// exrdisplay maps [0, 2^3.5] to the display range.
+static const float KNEE_DISPLAY_STOPS = 3.5f;
+
+
+// The knee curve log(x f + 1) / f.
+static double knee (const double x,
+                    const double f)
+{
+  return log (x * f + 1.0) / f;
+}
+
+
+// Finds the knee strength f for which knee(x, f) = y, by bisection like
+// exrdisplay does.
+static float find_knee_f (const double x,
+                          const double y)
+{
+  double f0 = 0.0;
+  double f1 = 1.0;
+  while (knee (x, f1) > y)
+    {
+      f0 = f1;
+      f1 = f1 * 2.0;
+    }
+  for (int i = 0; i < 30; ++i)
+    {
+      const double f2 = (f0 + f1) / 2.0;
+      if (knee (x, f2) < y)
+        {
+          f1 = f2;
+        }
+      else
+        {
+          f0 = f2;
+        }
+    }
+  return (float)((f0 + f1) / 2.0);
+}
+
+
+// Hable's curve with his published constants.
+static inline float hable (const float x)
+{
+  const float a = 0.15f;
+  const float b = 0.50f;
+  const float c = 0.10f;
+  const float d = 0.20f;
+  const float e = 0.02f;
+  const float f = 0.30f;
+  return (x * (a * x + c * b) + d * e) / (x * (a * x + b) + d * f) - e / f;
+}
+
+
+// Hable's exposure bias and linear white point.
+static const float HABLE_EXPOSURE_BIAS = 2.0f;
+static const float HABLE_WHITE         = 11.2f;
+
+
+// The ACES fit expects the scene exposure of the RRT, which is about 0.6x
+// ours.
+static const float ACES_EXPOSURE = 0.6f;
+
+
+
+//-----------------------------------------------------------------------------
+// Implementation of ToneCurve
+
+
+ToneCurve::ToneCurve (const ToneOperator op,
+                      const float        exposure,
+                      const float        white,
+                      const float        knee_low,
+                      const float        knee_high,
+                      const float        defog)
+:
+  m_operator (op),
+  m_white_scale (1.f),
+  m_defog (defog * exposure),
+  m_knee_exposure (powf (2.f, KNEE_EXPOSURE_OFFSET)),
+  m_knee_low (powf (2.f, knee_low)),
+  m_knee_f (1.f)
+{
+  switch (op)
+    {
+    case TONE_OPERATOR_REINHARD:
+      {
+        m_white_scale = 1.f / (white * white);
+        break;
+      }
+    case TONE_OPERATOR_HABLE:
+      {
+        m_white_scale = 1.f / hable (HABLE_WHITE);
+        break;
+      }
+    case TONE_OPERATOR_KNEE:
+      {
+        m_knee_f = find_knee_f (pow (2.0, knee_high) - m_knee_low,
+                                pow (2.0, KNEE_DISPLAY_STOPS) - m_knee_low);
+        break;
+      }
+    default:
+      {
+        break;
+      }
+    }
+}
+
+
+void ToneCurve::apply (float        *values,
+                       const size_t n) const
+{
+  switch (m_operator)
+    {
+    case TONE_OPERATOR_NONE:
+      {
+        break;
+      }
+    case TONE_OPERATOR_KNEE:
+      {
+        // knee(x) = log(x f + 1) / f, the log through fast_log2
+        const float defog     = m_defog;
+        const float exposure  = m_knee_exposure;
+        const float knee_low  = m_knee_low;
+        const float knee_f    = m_knee_f;
+        const float log_scale = 0.693147181f / knee_f;
+        const float display   = powf (2.f, -KNEE_DISPLAY_STOPS);
+        for (size_t i = 0; i < n; ++i)
+          {
+            const float x     = max_value (values[i] - defog, 0.f) * exposure;
+            const float above = max_value (x - knee_low, 0.f);
+            const float kneed = knee_low + fast_log2 (above * knee_f + 1.f) * log_scale;
+            values[i]         = (x > knee_low ? kneed : x) * display;
+          }
+        break;
+      }
+    case TONE_OPERATOR_REINHARD:
+      {
+        const float white_scale = m_white_scale;
+        for (size_t i = 0; i < n; ++i)
+          {
+            const float x = max_value (values[i], 0.f);
+            values[i]     = x * (1.f + x * white_scale) / (1.f + x);
+          }
+        break;
+      }
+    case TONE_OPERATOR_HABLE:
+      {
+        const float white_scale = m_white_scale;
+        for (size_t i = 0; i < n; ++i)
+          {
+            const float x = max_value (values[i], 0.f) * HABLE_EXPOSURE_BIAS;
+            values[i]     = hable (x) * white_scale;
+          }
+        break;
+      }
+    case TONE_OPERATOR_ACES:
+      {
+        for (size_t i = 0; i < n; ++i)
+          {
+            const float x = max_value (values[i], 0.f) * ACES_EXPOSURE;
+            values[i]     = (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+          }
+        break;
+      }
+    }
+}
+
+
+
+/* vim: set ts=2 sw=2 : */
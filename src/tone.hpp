@@ -0,0 +1,86 @@
+#ifndef _TONE_HPP_
+#define _TONE_HPP_ 1
+
+// system includes
+#include <cstddef>
+
+
+//-----------------------------------------------------------------------------
+// Global tone mapping operators, applied per channel to exposed linear values
+// before the display encoding.
+enum ToneOperator
+{
+  // no tone mapping, values above 1 clip
+  TONE_OPERATOR_NONE     = 0,
+  // exrdisplay's defog and knee curve, 18% gray lands on middle gray
+  TONE_OPERATOR_KNEE     = 1,
+  // extended Reinhard, x (1 + x / white^2) / (1 + x), white maps to 1
+  TONE_OPERATOR_REINHARD = 2,
+  // John Hable's filmic curve from Uncharted 2
+  TONE_OPERATOR_HABLE    = 3,
+  // Krzysztof Narkowicz's fit of the ACES RRT + sRGB ODT
+  TONE_OPERATOR_ACES     = 4,
+};
+
+
+//-----------------------------------------------------------------------------
+// Evaluates a tone operator on rows of floats. Every operator is a short
+// rational function, or a log for the knee, with no branches, so the loop
+// vectorizes and costs about as much as the plain exposure multiply.
+class ToneCurve
+{
+public:
+
+  // Creates the curve.
+  //
+  // @param[in]   op
+  //  tone operator
+  // @param[in]   exposure
+  //  linear exposure multiplier the values were scaled by, defog is
+  //  subtracted before exposure like in exrdisplay
+  // @param[in]   white
+  //  Reinhard white point, the exposed value that maps to 1
+  // @param[in]   knee_low, knee_high
+  //  knee start and end in stops, the knee compresses [knee_low, knee_high]
+  //  into the display range
+  // @param[in]   defog
+  //  amount of flare subtracted before exposure
+  ToneCurve (const ToneOperator op,
+             const float        exposure,
+             const float        white,
+             const float        knee_low,
+             const float        knee_high,
+             const float        defog);
+
+  // Returns the tone operator of this curve.
+  ToneOperator get_operator() const;
+
+  // Tone maps n linear values in place.
+  void apply (float        *values,
+              const size_t n) const;
+
+private:
+
+  // tone operator
+  ToneOperator m_operator;
+  // 1 / white^2 for Reinhard, 1 / f(white) for Hable
+  float        m_white_scale;
+  // knee curve: defog (exposed), extra exposure, knee start and strength
+  float        m_defog;
+  float        m_knee_exposure;
+  float        m_knee_low;
+  float        m_knee_f;
+};
+
+
+inline ToneOperator ToneCurve::get_operator() const
+{
+  return m_operator;
+}
+
+
+
+#endif // #ifndef _TONE_HPP_
+
+
+/* vim: set ts=2 sw=2 : */
@@ -0,0 +1,59 @@
+// plugin includes
+#include "fast_math.hpp"
+// myself
+#include "transfer.hpp"
+
+
+//-----------------------------------------------------------------------------
+// Implementation of TransferCurve
+
+
+TransferCurve::TransferCurve (const TransferFunction function,
+                              const float            gamma)
+:
+  m_function (function),
+  m_exponent (function == TRANSFER_FUNCTION_SRGB ? 1.f / 2.4f : 1.f / gamma)
+{}
+
+
+void TransferCurve::apply (float        *values,
+                           const size_t n) const
+{
+  const float exponent = m_exponent;
+  switch (m_function)
+    {
+    case TRANSFER_FUNCTION_LINEAR:
+      {
+        for (size_t i = 0; i < n; ++i)
+          {
+            values[i] = clamp01 (values[i]);
+          }
+        break;
+      }
+    case TRANSFER_FUNCTION_SRGB:
+      {
+        // both branches are evaluated and blended, that keeps the loop
+        // vectorizable
+        for (size_t i = 0; i < n; ++i)
+          {
+            const float x   = clamp01 (values[i]);
+            const float lin = 12.92f * x;
+            const float pw  = 1.055f * fast_pow (x, exponent) - 0.055f;
+            values[i]       = x <= 0.0031308f ? lin : pw;
+          }
+        break;
+      }
+    case TRANSFER_FUNCTION_GAMMA:
+      {
+        for (size_t i = 0; i < n; ++i)
+          {
+            values[i] = fast_pow (clamp01 (values[i]), exponent);
+          }
+        break;
+      }
+    }
+}
+
+
+
+/* vim: set ts=2 sw=2 : */
@@ -0,0 +1,83 @@
+#ifndef _WORKER_THREAD_HPP_
+#define _WORKER_THREAD_HPP_ 1
+
+// GIMP includes
+#include <glib.h>
+
+
+//-----------------------------------------------------------------------------
+// Runs a member function of an object on a thread of its own. Deleting the
+// worker joins the thread, so an owner that deletes its worker before
+// anything else knows the thread is gone before any of the members it
+// touches are destroyed; no semaphore is posted by a thread on its way out.
+//
+// The thread is a GLib one: IlmThread::Thread only joins in its destructor
+// since OpenEXR 2.3, before that it detaches, and it is destroyed after the
+// members of the classes that derive from it anyway.
+template<typename T>
+class WorkerThread
+{
+public:
+
+  typedef void (T::*Function)();
+
+  // Starts calling (owner.*function)() on the thread.
+  WorkerThread (T              &owner,
+                const Function function);
+
+  // Waits for the function to return.
+  ~WorkerThread ();
+
+private:
+
+  // Entry point of the thread.
+  static gpointer enter (gpointer data);
+
+  // not copyable
+  WorkerThread (const WorkerThread&);
+  WorkerThread& operator= (const WorkerThread&);
+
+  T              &m_owner;
+  const Function m_function;
+  GThread        *m_thread;
+};
+
+
+
+//-----------------------------------------------------------------------------
+// Implementation of WorkerThread
+
+
+template<typename T>
+WorkerThread<T>::WorkerThread (T              &owner,
+                               const Function function)
+:
+  m_owner (owner),
+  m_function (function),
+  m_thread (NULL)
+{
+  m_thread = g_thread_new ("exr-worker", &WorkerThread::enter, this);
+}
+
+
+template<typename T>
+WorkerThread<T>::~WorkerThread ()
+{
+  g_thread_join (m_thread);
+}
+
+
+template<typename T>
+gpointer WorkerThread<T>::enter (gpointer data)
+{
+  WorkerThread *worker = (WorkerThread*)data;
+  (worker->m_owner.*worker->m_function) ();
+  return NULL;
+}
+
+
+
+#endif // #ifndef _WORKER_THREAD_HPP_
+
+
+/* vim: set ts=2 sw=2 : */